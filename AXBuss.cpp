@@ -16,15 +16,20 @@
 //-----------------------------------------------------------------------------
 bool g_data_output_to_usb = false;
 bool g_AX_IS_TX = false;
+uint32_t g_bus_last_tx_cycles = 0;
+bool g_bus_tx_queued = false;
+uint32_t g_bus_release_last_cycles = 0;
+uint32_t g_bus_release_max_cycles = 0;
 uint8_t ax_tohost_state = AX_SEARCH_FIRST_FF;
 uint8_t ax_tohost_len;
+uint8_t ax_tohost_id;
+uint8_t ax_tohost_packet_len;
+bool ax_tohost_error_next;
 uint8_t ax_receive_toggle = 0;
 
 // See if doing single write to USB speeds things up... 
-#ifdef BUFFER_TO_USB
 uint8_t g_abToUSBBuffer[256]; // way more than enough buffer space
 uint8_t g_abToUSBCnt;
-#endif
 //-----------------------------------------------------------------------------
 // ProcessInputFromAXBuss - We want to do this in a way that will not
 //    cause the function to have to wait.
@@ -36,6 +41,11 @@ bool ProcessInputFromAXBuss(void)
   uint8_t loop_count;
   bool characters_read = false;
 
+#ifdef AX_TX_COMPLETE_TURNAROUND
+  // See if the UART has already turned the buss around for us
+  setAXtoRX();
+#endif
+
   // See if any characters are available.
   // We keep a quick and dirty state of message
   // processing as a way to see if we should try to quickly push data back to host
@@ -71,17 +81,33 @@ bool ProcessInputFromAXBuss(void)
 
         case PACKET_ID:
           ax_tohost_state = (ch == 0xFF) ? PACKET_ID : PACKET_LENGTH;
+          ax_tohost_id = ch;
           break;
 
         case PACKET_LENGTH:
           ax_tohost_len = ch; // number of bytes remaining in packet.
+          ax_tohost_packet_len = ch;
           ax_tohost_state = AX_PASS_TO_SERVOS;
+          ax_tohost_error_next = true;
           break;
 
         case AX_PASS_TO_SERVOS:
+          if (ax_tohost_error_next) {
+            // First byte after length of a status packet is the servos error byte
+            ax_tohost_error_next = false;
+            ServoHealthNoteStatus(ax_tohost_id, ch);
+            if (ch)
+              WriteShadowInvalidate(ax_tohost_id);   // servo is not happy, do not trust what we know
+          }
+          if (ax_tohost_id == g_shadow_pending_id) {
+            // Let the write shadow check the answer to the read it saw go out
+            WriteShadowNoteStatus(ax_tohost_id, (int)ax_tohost_packet_len - 1 - ax_tohost_len, ch);
+          }
           ax_tohost_len--;
-          if (ax_tohost_len == 0)
+          if (ax_tohost_len == 0) {
             ax_tohost_state = AX_SEARCH_FIRST_FF;
+            BusSchedulerNoteReply();
+          }
           break;
 
         default:
@@ -111,11 +137,10 @@ bool ProcessInputFromAXBuss(void)
 //-----------------------------------------------------------------------------
 // If we are in pass through and we don't still have any data coming in to
 // us, maybe we should tell USB to send back the data now!
+// The host transport decides what a flush needs to do, if anything.
 //-----------------------------------------------------------------------------
 void MaybeFlushUSBOutputData()
 {
-#ifdef PCSerial_USB
-  // If we are communicating with USB, then maybe want to do flushes.  If not probably don't need to.
   if (g_data_output_to_usb)
   {
     g_data_output_to_usb = false;
@@ -126,14 +151,58 @@ void MaybeFlushUSBOutputData()
     PCSerial.flush();
     debug_digitalWrite( 3, LOW);
   }
-#endif
+}
+
+//-----------------------------------------------------------------------------
+// AXBussNoteRelease - The buss just went back to RX, remember how long that
+//    took after the last byte was queued.  This includes the time the queued
+//    bytes take on the wire, so compare the two turnaround modes with the
+//    same traffic.  With AX_TX_COMPLETE_TURNAROUND we are called when the
+//    main loop notices the UART released the buss, not from the interrupt,
+//    so that mode also counts the time until the loop came around.  A release
+//    with nothing queued before it (setup) is not a turnaround, so not timed.
+//-----------------------------------------------------------------------------
+void AXBussNoteRelease(void)
+{
+  if (!g_bus_tx_queued)
+    return;
+  g_bus_tx_queued = false;
+  g_bus_release_last_cycles = ARM_DWT_CYCCNT - g_bus_last_tx_cycles;
+  if (g_bus_release_last_cycles > g_bus_release_max_cycles)
+    g_bus_release_max_cycles = g_bus_release_last_cycles;
+}
+
+//-----------------------------------------------------------------------------
+// AXBussClearRelease - Host wrote TA_BUS_RELEASE_CLEAR.
+//-----------------------------------------------------------------------------
+void AXBussClearRelease(void)
+{
+  g_bus_release_last_cycles = 0;
+  g_bus_release_max_cycles = 0;
+}
+
+//-----------------------------------------------------------------------------
+// AXBussUpdateRegisters - Copy the release times into the register table
+//-----------------------------------------------------------------------------
+void AXBussUpdateRegisters(void)
+{
+  LocalRegistersSetWord(TA_BUS_RELEASE_LAST_US_L, g_bus_release_last_cycles / (F_CPU / 1000000));
+  LocalRegistersSetWord(TA_BUS_RELEASE_MAX_US_L, g_bus_release_max_cycles / (F_CPU / 1000000));
 }
 
 //-----------------------------------------------------------------------------
 // axStatusPacket - Send status packet back through USB
 //-----------------------------------------------------------------------------
 void axStatusPacket(uint8_t err, uint8_t* data, uint8_t count_bytes) {
-  uint16_t checksum = AX_ID_DEVICE + 2 + count_bytes + err;
+  axStatusPacketID(AX_ID_DEVICE, err, data, count_bytes);
+}
+
+//-----------------------------------------------------------------------------
+// axStatusPacketID - Send status packet back through USB as if it came from
+//    the given ID.
+//-----------------------------------------------------------------------------
+void axStatusPacketID(uint8_t id, uint8_t err, uint8_t* data, uint8_t count_bytes) {
+  uint16_t checksum = id + 2 + count_bytes + err;
 #ifdef DBGSerial
   DBGSerial.printf("SP: %d %d\n\r", err, count_bytes);
 #endif
@@ -142,7 +211,7 @@ void axStatusPacket(uint8_t err, uint8_t* data, uint8_t count_bytes) {
   g_abToUSBCnt = 0;
   g_abToUSBBuffer[g_abToUSBCnt++] = (0xff);
   g_abToUSBBuffer[g_abToUSBCnt++] = (0xff);
-  g_abToUSBBuffer[g_abToUSBCnt++] = (AX_ID_DEVICE);
+  g_abToUSBBuffer[g_abToUSBCnt++] = (id);
   g_abToUSBBuffer[g_abToUSBCnt++] = (2 + count_bytes);
   g_abToUSBBuffer[g_abToUSBCnt++] = (err);
   for (uint8_t i = 0; i < count_bytes; i++) {
@@ -154,7 +223,7 @@ void axStatusPacket(uint8_t err, uint8_t* data, uint8_t count_bytes) {
 #else
   PCSerial.write(0xff);
   PCSerial.write(0xff);
-  PCSerial.write(AX_ID_DEVICE);
+  PCSerial.write(id);
   PCSerial.write(2 + count_bytes);
   PCSerial.write(err);
   for (uint8_t i = 0; i < count_bytes; i++) {
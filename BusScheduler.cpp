@@ -0,0 +1,149 @@
+//=============================================================================
+// File: BusScheduler.cpp
+//  Arbitrate the half duplex AX Buss between the packets the host sends us
+//  and any work the firmware wants to do on its own (polling, probes...).
+//
+//  Host packets are never queued, ProcessInputFromUSB forwards them as they
+//  arrive, so host writes and host reads always win.  We only track them so
+//  we know when the buss is in use or when a servo may still be answering the
+//  host.  Background transactions are queued here and are only started when
+//  the host has been quiet long enough that the transaction plus the buss
+//  turnarounds fits in the gap.  We only ever run one transaction per call,
+//  so any new host data preempts us between transactions.
+//=============================================================================
+
+//=============================================================================
+// Header Files
+//=============================================================================
+#include <ax12Serial.h>
+#include <BioloidSerial.h>
+#include "globals.h"
+
+//-----------------------------------------------------------------------------
+// Define Global variables
+//-----------------------------------------------------------------------------
+typedef struct {
+  BusTaskFunction task;
+  uint16_t        est_us;       // How long we expect the transaction to hold the buss
+  unsigned long   queued_time;
+} bus_task_t;
+
+bus_task_t g_bus_tasks[BUS_TASK_QUEUE_SIZE];
+uint8_t g_bus_task_head = 0;
+uint8_t g_bus_task_count = 0;
+
+uint32_t g_bus_turnaround_cycles = 0;   // worst case cost of setAXtoTX/setAXtoRX
+
+bool g_bus_host_waiting_reply = false;  // a servo may still be answering the host
+unsigned long g_bus_host_packet_time;   // when the last host packet finished
+
+// Statistics
+uint8_t g_bus_max_queue_depth = 0;
+uint32_t g_bus_last_wait_us = 0;
+uint32_t g_bus_max_wait_us = 0;
+
+//-----------------------------------------------------------------------------
+// BusSchedulerInit - Called from setup.  We use the cycle counter to measure
+//    the cost of the turnarounds, so make sure it is running.
+//-----------------------------------------------------------------------------
+void BusSchedulerInit(void)
+{
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+}
+
+//-----------------------------------------------------------------------------
+// BusSchedulerQueue - Queue up a background transaction.  Returns false if
+//    the queue is full.
+//-----------------------------------------------------------------------------
+bool BusSchedulerQueue(BusTaskFunction task, uint16_t est_us)
+{
+  if (g_bus_task_count >= BUS_TASK_QUEUE_SIZE)
+    return false;
+
+  bus_task_t *pbt = &g_bus_tasks[(g_bus_task_head + g_bus_task_count) % BUS_TASK_QUEUE_SIZE];
+  pbt->task = task;
+  pbt->est_us = est_us;
+  pbt->queued_time = micros();
+  g_bus_task_count++;
+  if (g_bus_task_count > g_bus_max_queue_depth)
+    g_bus_max_queue_depth = g_bus_task_count;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// BusSchedulerNoteHostPacket - ProcessInputFromUSB has finished forwarding a
+//    packet from the host to the servos.
+//-----------------------------------------------------------------------------
+void BusSchedulerNoteHostPacket(uint8_t priority)
+{
+  g_bus_host_packet_time = micros();
+
+  // Reads always get an answer, writes only if the servos return all status
+  g_bus_host_waiting_reply = (priority == BUS_PRIORITY_HOST_READ)
+                             || (g_controller_registers[CM730_STATUS_RETURN_LEVEL] >= 2);
+}
+
+//-----------------------------------------------------------------------------
+// BusSchedulerNoteReply - ProcessInputFromAXBuss saw a complete status packet
+//    go back to the host, so the buss is free again.
+//-----------------------------------------------------------------------------
+void BusSchedulerNoteReply(void)
+{
+  g_bus_host_waiting_reply = false;
+}
+
+//-----------------------------------------------------------------------------
+// BusSchedulerRun - If the host is quiet long enough, run the next background
+//    transaction.  Returns true if we did something.
+//-----------------------------------------------------------------------------
+bool BusSchedulerRun(void)
+{
+  if (!g_bus_task_count)
+    return false;
+
+  // Never break into a host packet or any data still waiting in USB queue.
+  if ((ax_state != AX_SEARCH_FIRST_FF) || PCSerial.available())
+    return false;
+
+  unsigned long cur_time = micros();
+
+  // Give a servo the time it is allowed to answer the host.
+  if (g_bus_host_waiting_reply) {
+    if ((cur_time - g_bus_host_packet_time) < (20 * (uint32_t)g_controller_registers[TA_RECEIVE_TIMEOUT]))
+      return false;
+    g_bus_host_waiting_reply = false;
+  }
+
+  // Only use the gap if the host has been quiet at least as long as we will
+  // hold the buss, including turning it around both ways.
+  bus_task_t *pbt = &g_bus_tasks[g_bus_task_head];
+  uint32_t needed_us = pbt->est_us + BUS_IDLE_GUARD_US
+                       + (2 * g_bus_turnaround_cycles) / (F_CPU / 1000000);
+  if ((cur_time - last_message_time) < needed_us)
+    return false;
+
+  g_bus_last_wait_us = cur_time - pbt->queued_time;
+  if (g_bus_last_wait_us > g_bus_max_wait_us)
+    g_bus_max_wait_us = g_bus_last_wait_us;
+
+  BusTaskFunction task = pbt->task;
+  g_bus_task_head = (g_bus_task_head + 1) % BUS_TASK_QUEUE_SIZE;
+  g_bus_task_count--;
+
+  (*task)();
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// BusSchedulerUpdateRegisters - Copy our statistics into the register table
+//    when the host asks for them.
+//-----------------------------------------------------------------------------
+void BusSchedulerUpdateRegisters(void)
+{
+  g_controller_registers[TA_SCHED_QUEUE_DEPTH] = g_bus_task_count;
+  g_controller_registers[TA_SCHED_MAX_QUEUE_DEPTH] = g_bus_max_queue_depth;
+  LocalRegistersSetWord(TA_SCHED_LAST_WAIT_L, g_bus_last_wait_us);
+  LocalRegistersSetWord(TA_SCHED_MAX_WAIT_L, g_bus_max_wait_us);
+  LocalRegistersSetWord(TA_BUS_TURNAROUND_L, (g_bus_turnaround_cycles * 10) / (F_CPU / 1000000));
+}
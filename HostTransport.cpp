@@ -0,0 +1,200 @@
+//=============================================================================
+// File: HostTransport.cpp
+//  The backends for the link to the host, and which one we use.
+//=============================================================================
+
+//=============================================================================
+// Header Files
+//=============================================================================
+#include <ax12Serial.h>
+#include <BioloidSerial.h>
+#include "globals.h"
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#endif
+
+//-----------------------------------------------------------------------------
+// Define Global variables
+//-----------------------------------------------------------------------------
+#if defined(HOST_TRANSPORT_RAWHID)
+HostTransportRawHID g_host_transport_default;
+#elif defined(HOST_TRANSPORT_UART)
+HostTransportUART g_host_transport_default(HOST_TRANSPORT_UART);
+#else
+HostTransportCDC g_host_transport_default;
+#endif
+HostTransport *g_host_transport = &g_host_transport_default;
+
+#if defined(USB_RAWHID)
+//-----------------------------------------------------------------------------
+// HostTransportRawHID
+//-----------------------------------------------------------------------------
+bool HostTransportRawHID::receiveReport(void)
+{
+  while (rx_index_ > rx_report_[0]) {
+    if (RawHID.recv(rx_report_, 0) <= 0) {
+      rx_report_[0] = 0;
+      rx_index_ = 1;
+      return false;
+    }
+    if (rx_report_[0] >= RAWHID_REPORT_SIZE)
+      rx_report_[0] = RAWHID_REPORT_SIZE - 1;
+    rx_index_ = 1;
+  }
+  return true;
+}
+
+int HostTransportRawHID::available(void)
+{
+  if (!receiveReport())
+    return 0;
+  return rx_report_[0] + 1 - rx_index_;
+}
+
+int HostTransportRawHID::read(void)
+{
+  if (!receiveReport())
+    return -1;
+  return rx_report_[rx_index_++];
+}
+
+size_t HostTransportRawHID::write(const uint8_t *buffer, size_t size)
+{
+  for (size_t i = 0; i < size; i++) {
+    tx_report_[++tx_count_] = buffer[i];
+    if (tx_count_ == (RAWHID_REPORT_SIZE - 1))
+      flush();
+  }
+  return size;
+}
+
+void HostTransportRawHID::flush(void)
+{
+  if (tx_count_) {
+    tx_report_[0] = tx_count_;
+    memset(&tx_report_[tx_count_ + 1], 0, RAWHID_REPORT_SIZE - 1 - tx_count_);
+    RawHID.send(tx_report_, 10);
+    tx_count_ = 0;
+  }
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// HostTransportLoopback
+//-----------------------------------------------------------------------------
+int HostTransportLoopback::available(void)
+{
+  return (uint8_t)(to_device_head_ - to_device_tail_);
+}
+
+int HostTransportLoopback::read(void)
+{
+  if (to_device_head_ == to_device_tail_)
+    return -1;
+  return to_device_[to_device_tail_++];
+}
+
+size_t HostTransportLoopback::write(const uint8_t *buffer, size_t size)
+{
+  if (size && request_pending_) {
+    request_pending_ = false;
+    round_trip_last_us = micros() - request_time_;
+    if (round_trip_last_us > round_trip_max_us)
+      round_trip_max_us = round_trip_last_us;
+    round_trips++;
+  }
+  if (to_host_sink) {
+    (*to_host_sink)(buffer, size);
+    return size;
+  }
+  size_t i;
+  for (i = 0; (i < size) && ((uint8_t)(to_host_head_ + 1) != to_host_tail_); i++)
+    to_host_[to_host_head_++] = buffer[i];
+  to_host_dropped += size - i;
+  return i;
+}
+
+size_t HostTransportLoopback::inject(const uint8_t *buffer, size_t size)
+{
+  if (size && !request_pending_) {
+    request_pending_ = true;
+    request_time_ = micros();
+  }
+  size_t i;
+  for (i = 0; (i < size) && ((uint8_t)(to_device_head_ + 1) != to_device_tail_); i++)
+    to_device_[to_device_head_++] = buffer[i];
+  return i;
+}
+
+size_t HostTransportLoopback::take(uint8_t *buffer, size_t size)
+{
+  size_t i;
+  for (i = 0; (i < size) && (to_host_head_ != to_host_tail_); i++)
+    buffer[i] = to_host_[to_host_tail_++];
+  return i;
+}
+
+#if defined(__linux__)
+//-----------------------------------------------------------------------------
+// HostTransportPty
+//-----------------------------------------------------------------------------
+void HostTransportPty::begin(uint32_t baud)
+{
+  fd_ = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd_ < 0)
+    return;
+  grantpt(fd_);
+  unlockpt(fd_);
+  struct termios tio;
+  if (tcgetattr(fd_, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(fd_, TCSANOW, &tio);
+  }
+}
+
+const char *HostTransportPty::slaveName(void)
+{
+  return (fd_ < 0) ? NULL : ptsname(fd_);
+}
+
+int HostTransportPty::available(void)
+{
+  if (peek_ == -1)
+    peek_ = read();
+  return (peek_ != -1) ? 1 : 0;
+}
+
+int HostTransportPty::read(void)
+{
+  uint8_t b;
+  if (peek_ != -1) {
+    int ch = peek_;
+    peek_ = -1;
+    return ch;
+  }
+  if ((fd_ < 0) || (::read(fd_, &b, 1) != 1))
+    return -1;
+  if (!request_pending_) {
+    request_pending_ = true;
+    request_time_ = micros();
+  }
+  return b;
+}
+
+size_t HostTransportPty::write(const uint8_t *buffer, size_t size)
+{
+  if (fd_ < 0)
+    return 0;
+  if (size && request_pending_) {
+    request_pending_ = false;
+    round_trip_last_us = micros() - request_time_;
+    if (round_trip_last_us > round_trip_max_us)
+      round_trip_max_us = round_trip_last_us;
+    round_trips++;
+  }
+  ssize_t count = ::write(fd_, buffer, size);
+  return (count > 0) ? count : 0;
+}
+#endif
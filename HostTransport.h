@@ -0,0 +1,173 @@
+#ifndef _HOST_TRANSPORT_H_
+#define _HOST_TRANSPORT_H_
+//=============================================================================
+// File: HostTransport.h
+//  The link to the host (PC, Mac, SBC...).  Everything that talks to the host
+//  goes through PCSerial, which is the selected HostTransport.  Each backend
+//  decides its own batching: flush() means we finished a reply, and it is up
+//  to the backend what, if anything, that needs to do.
+//=============================================================================
+
+class HostTransport
+{
+public:
+  virtual void begin(uint32_t baud) {}
+  virtual int available(void) = 0;
+  virtual int read(void) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+  virtual size_t write(uint8_t b) {
+    return write(&b, 1);
+  }
+  virtual void flush(void) {}
+  virtual void clear(void) {
+    while (read() != -1)
+      ;
+  }
+};
+
+//-----------------------------------------------------------------------------
+// USB Serial (CDC) - Teensy packs our writes into 64 byte USB packets and only
+//    sends a partial one after a timeout, so flush sends it now.
+//-----------------------------------------------------------------------------
+class HostTransportCDC : public HostTransport
+{
+public:
+  virtual void begin(uint32_t baud) {
+    Serial.begin(baud);
+  }
+  virtual int available(void) {
+    return Serial.available();
+  }
+  virtual int read(void) {
+    return Serial.read();
+  }
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    return Serial.write(buffer, size);
+  }
+  virtual void flush(void) {
+    Serial.flush();
+  }
+  virtual void clear(void) {
+#if defined(TEENSYDUINO)
+    Serial.clear();
+#else
+    HostTransport::clear();
+#endif
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Hardware UART - bytes go out as soon as the UART can take them, so there is
+//    nothing to batch and we never wait for them on flush.
+//-----------------------------------------------------------------------------
+class HostTransportUART : public HostTransport
+{
+public:
+  HostTransportUART(HardwareSerial &serial) : serial_(serial) {}
+  virtual void begin(uint32_t baud) {
+    serial_.begin(baud);
+  }
+  virtual int available(void) {
+    return serial_.available();
+  }
+  virtual int read(void) {
+    return serial_.read();
+  }
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    return serial_.write(buffer, size);
+  }
+  virtual void clear(void) {
+    serial_.clear();
+  }
+private:
+  HardwareSerial &serial_;
+};
+
+#if defined(HOST_TRANSPORT_RAWHID) && !defined(USB_RAWHID)
+#error HOST_TRANSPORT_RAWHID needs Tools->USB Type set to Raw HID
+#endif
+
+#if defined(USB_RAWHID)
+//-----------------------------------------------------------------------------
+// Raw HID - 64 byte reports, first byte is how many of the remaining 63 are
+//    data.  A report goes out when full or when a reply is finished.
+//-----------------------------------------------------------------------------
+#define RAWHID_REPORT_SIZE    64
+class HostTransportRawHID : public HostTransport
+{
+public:
+  virtual int available(void);
+  virtual int read(void);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  virtual void flush(void);
+private:
+  bool receiveReport(void);
+  uint8_t rx_report_[RAWHID_REPORT_SIZE];
+  uint8_t rx_index_ = 1;
+  uint8_t tx_report_[RAWHID_REPORT_SIZE];
+  uint8_t tx_count_ = 0;
+};
+#endif
+
+//-----------------------------------------------------------------------------
+// Loopback - in memory queues that a test harness feeds and drains, it also
+//    measures the time from a request being fed in to the first byte of the
+//    reply.  The queue to the host only holds 255 bytes, and one pass of the
+//    loop can send more (a segmented sync read), so a harness that cannot
+//    drain it in time should set to_host_sink to get the bytes as they are
+//    written.  Anything that did not fit is counted in to_host_dropped.
+//-----------------------------------------------------------------------------
+#define LOOPBACK_QUEUE_SIZE   256
+class HostTransportLoopback : public HostTransport
+{
+public:
+  virtual int available(void);
+  virtual int read(void);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+
+  // Harness side
+  size_t inject(const uint8_t *buffer, size_t size);  // host -> us
+  size_t take(uint8_t *buffer, size_t size);          // us -> host
+  void (*to_host_sink)(const uint8_t *buffer, size_t size) = NULL;
+  uint32_t to_host_dropped = 0;
+  uint32_t round_trip_last_us = 0;
+  uint32_t round_trip_max_us = 0;
+  uint32_t round_trips = 0;
+private:
+  uint8_t to_device_[LOOPBACK_QUEUE_SIZE];
+  uint8_t to_host_[LOOPBACK_QUEUE_SIZE];
+  uint8_t to_device_head_ = 0, to_device_tail_ = 0;
+  uint8_t to_host_head_ = 0, to_host_tail_ = 0;
+  bool request_pending_ = false;
+  unsigned long request_time_;
+};
+
+#if defined(__linux__)
+//-----------------------------------------------------------------------------
+// Pseudo terminal - only for host builds, lets the normal host software talk
+//    to the firmware running on the PC (see extras/replay, replay --pty).  It
+//    measures the time from a request coming in to the first byte of the
+//    reply the same way the loopback does.
+//-----------------------------------------------------------------------------
+class HostTransportPty : public HostTransport
+{
+public:
+  virtual void begin(uint32_t baud);
+  virtual int available(void);
+  virtual int read(void);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  const char *slaveName(void);
+  uint32_t round_trip_last_us = 0;
+  uint32_t round_trip_max_us = 0;
+  uint32_t round_trips = 0;
+private:
+  int fd_ = -1;
+  int peek_ = -1;
+  bool request_pending_ = false;
+  unsigned long request_time_;
+};
+#endif
+
+extern HostTransport *g_host_transport;
+
+#endif
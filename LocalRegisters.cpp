@@ -21,7 +21,7 @@ uint8_t g_controller_registers[REG_TABLE_SIZE] = {MODEL_NUMBER_L, MODEL_NUMBER_H
                                                   0, 0, 0, 0, LOW_VOLTAGE_SHUTOFF_DEFAULT, 0, 0, 0, RETURN_LEVEL
                                                  };
 
-const uint8_t g_controller_registers_ranges[][2] =
+const uint8_t g_controller_registers_ranges[REG_TABLE_SIZE][2] =
 {
   {1, 0},   //MODEL_NUMBER_L        0
   {1, 0},   //MODEL_NUMBER_H        1
@@ -37,7 +37,43 @@ const uint8_t g_controller_registers_ranges[][2] =
 
   // Not saved to eeprom...
   {1, 0}, {1, 0},  {1, 0},  {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 17-23
-
+  {0, 1},   //DXL_POWER             24
+  {0, 3},   //LED_PANEL             25
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 26-33
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 34-41
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 42-49
+  {1, 0},   //VOLTAGE               50
+
+  // Teensy added
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 51-58 Scheduler statistics
+  {1, 0}, {1, 0},   //VOLTAGE_MV      59-60
+  {1, 0}, {1, 0}, {1, 0},           // 61-63 Health summary
+  {0, 253}, //HEALTH_DETAIL_ID      64
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 65-69 Health detail
+  {0, 1},   //HEALTH_CLEAR          70
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 71-102 Health fail map
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0},
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0},
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0},
+  {0, 31},  //SYNC_READ_MODE        103
+  {0, 255}, //SYNC_READ_RETRIES     104
+  {0, 255}, //SYNC_READ_DEADLINE    105
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 106-113 Retry statistics
+  {1, 0}, {1, 0}, {1, 0}, {1, 0}, // 114-117 Buss release times
+  {0, 255}, //SYNC_READ_KEYFRAME    118
+  {0, 1},   //TRAJ_ENABLE           119
+  {0, 255}, //TRAJ_PERIOD           120
+  {0, 253}, //TRAJ_ID               121
+  {0, 255}, {0, 15},                // 122-123 TRAJ_GOAL
+  {0, 255}, {0, 255},               // 124-125 TRAJ_TIME
+  {0, 1},   //TRAJ_SHAPE            126
+  {0, 3},   //TRAJ_COMMIT           127
+  {1, 0}, {1, 0},                   // 128-129 Trajectory status
+  {0, 2},   //SHADOW_MODE           130
+  {1, 0}, {1, 0}, {1, 0}, {1, 0},   // 131-134 Shadow statistics
+  {0, 1},   //SHADOW_CLEAR          135
+  {0, 1},   //BUS_RELEASE_CLEAR     136
+  {0, 1},   //SYNC_READ_RETRY_CLEAR 137
 };
 
 
@@ -66,7 +102,7 @@ void LocalRegistersRead(uint8_t register_id, uint8_t count_bytes)
 
   // Several ranges of logical registers to process.
   uint16_t top = (uint16_t)register_id + count_bytes;
-  if ( count_bytes == 0  || (top >= REG_TABLE_SIZE))
+  if ( count_bytes == 0  || (top > REG_TABLE_SIZE))
   {
     axStatusPacket( ERR_RANGE, NULL, 0 );
     return;
@@ -106,51 +142,68 @@ void LocalRegistersWrite(uint8_t register_id, uint8_t* data, uint8_t count_bytes
 
 
 //--------------------------------------------------------------------
-// CheckBatteryVoltage - We will call this from main loop.
-//    It does some averaging of voltage reads to get a better consisten
-//    voltage.  It will also try to detec when the voltage goes to low
-//    either due to the battery is getting low or turned off.  Likewise
-//    may detect when battery is turned on...
+// Battery voltage monitor - An IntervalTimer starts an ADC conversion
+//    every VOLTAGE_SAMPLE_US and picks up the result of the previous one,
+//    so we never wait on analogRead.  The samples go through a fixed point
+//    IIR filter, and a big jump (battery turned on or off) resets the filter
+//    instead of waiting for it to catch up.
 //--------------------------------------------------------------------
 
-// Warning may need to increase sizes if we go beyond 10bit analog reads
-#define MAX_ANALOG_DELTA 50
-uint16_t  g_awVoltages[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-uint16_t  g_wVoltageSum = 0;
-uint8_t   g_iVoltages = 0;
+// Warning may need to increase sizes if we go beyond 12bit analog reads
+#define MAX_ANALOG_DELTA 200
+IntervalTimer g_voltage_timer;
+uint8_t   g_voltage_adc_channel;        // SC1A channel analogRead setup for our pin
+volatile uint32_t g_voltage_filtered;   // ADC counts << VOLTAGE_FRACTION_BITS
+volatile uint16_t g_voltage_mv = 0;
+volatile bool g_voltage_shutoff_pending = false;
 
-void CheckBatteryVoltage(void)
+void BatteryVoltageTimerInterrupt(void)
 {
-  // Get the current voltage
-  uint16_t cur_analog = analogRead(VOLTAGE_ANALOG_PIN);
-
-  if (abs((int)cur_analog - (int)(g_wVoltageSum / 8)) > MAX_ANALOG_DELTA)
-  {
-    // Lets read 8 times and reset sum...
-    g_wVoltageSum = 0;
-    for (g_iVoltages = 0; g_iVoltages < 8; g_iVoltages++)
-    {
-      g_awVoltages[g_iVoltages] = analogRead(VOLTAGE_ANALOG_PIN);
-      g_wVoltageSum += g_awVoltages[g_iVoltages];
-    }
-  }
-  else
-  {
-    g_iVoltages++;
-    g_iVoltages &= 0x7;  // setup index to our array...
-    g_wVoltageSum -= g_awVoltages[g_iVoltages];
-    g_awVoltages[g_iVoltages] = cur_analog;
-    g_wVoltageSum += cur_analog;
+  if (ADC0_SC1A & ADC_SC1_COCO) {
+    int32_t sample = (int32_t)ADC0_RA << VOLTAGE_FRACTION_BITS;
+    int32_t delta = sample - (int32_t)g_voltage_filtered;
+    if (abs(delta) > (MAX_ANALOG_DELTA << VOLTAGE_FRACTION_BITS))
+      g_voltage_filtered = sample;
+    else
+      g_voltage_filtered += delta >> VOLTAGE_FILTER_SHIFT;
+
+    uint16_t mv = (g_voltage_filtered * VOLTAGE_MV_SCALE) >> 16;
+    g_voltage_mv = mv;
+    g_controller_registers[CM730_VOLTAGE] = mv / 100;
+
+    // Check to see if voltage went low and our servos are on and a low voltage value is set.
+    if (g_controller_registers[CM730_DXL_POWER] && g_controller_registers[TA_DOWN_LIMIT_VOLTAGE]
+        && (g_controller_registers[CM730_VOLTAGE] <  g_controller_registers[TA_DOWN_LIMIT_VOLTAGE] ))
+      g_voltage_shutoff_pending = true;
   }
-  // Warning - using resistor values like 10000 and 40200 will overflow 32 bit math, but simply need right ratio. so wuse 100 and 402
-  g_controller_registers[CM730_VOLTAGE] = (uint32_t)(g_wVoltageSum * 33 * (uint32_t)(VOLTAGE_DIVIDER_RES1 + VOLTAGE_DIVIDER_RES2))
-                                          / (uint32_t)(1024 * 8 * (uint32_t)VOLTAGE_DIVIDER_RES1);
+  // Start the next conversion, we will pick it up next time.
+  ADC0_SC1A = g_voltage_adc_channel;
+}
 
-  // Check to see if voltage went low and our servos are on and a low voltage value is set.
-  if (g_controller_registers[CM730_DXL_POWER] && g_controller_registers[TA_DOWN_LIMIT_VOLTAGE]
-      && (g_controller_registers[CM730_VOLTAGE] <  g_controller_registers[TA_DOWN_LIMIT_VOLTAGE] ))
+//--------------------------------------------------------------------
+// BatteryMonitorInit - Let analogRead setup the ADC and mux for our pin
+//    once, then remember the channel and let the timer take over.
+//--------------------------------------------------------------------
+void BatteryMonitorInit(void)
+{
+  analogReadResolution(VOLTAGE_ADC_BITS);
+  g_voltage_filtered = (uint32_t)analogRead(VOLTAGE_ANALOG_PIN) << VOLTAGE_FRACTION_BITS;
+  g_voltage_adc_channel = ADC0_SC1A & ADC_SC1_ADCH(0x1f);
+  ADC0_SC1A = g_voltage_adc_channel;
+  g_voltage_timer.begin(BatteryVoltageTimerInterrupt, VOLTAGE_SAMPLE_US);
+}
+
+//--------------------------------------------------------------------
+// CheckBatteryVoltage - We will call this from main loop.  The voltage is
+//    kept up to date by the timer, all we do here is turn off the servos
+//    if it found the voltage went too low.
+//--------------------------------------------------------------------
+void CheckBatteryVoltage(void)
+{
+  if (g_voltage_shutoff_pending)
   {
     // Power is too low to run servos so shut them off
+    g_voltage_shutoff_pending = false;
     g_controller_registers[CM730_DXL_POWER] = 0;  // Turn it logically off.
     UpdateHardwareAfterLocalWrite(CM730_DXL_POWER, 1);  // use the update function to do the real work.
   }
@@ -163,8 +216,33 @@ void CheckBatteryVoltage(void)
 //-----------------------------------------------------------------------------
 void CheckHardwareForLocalReadRequest(uint8_t register_id, uint8_t count_bytes)
 {
-#if 0
-#endif
+  uint16_t top = (uint16_t)register_id + count_bytes;
+  if ((register_id <= TA_BUS_TURNAROUND_H) && (top > TA_SCHED_QUEUE_DEPTH))
+    BusSchedulerUpdateRegisters();
+  if ((register_id <= TA_VOLTAGE_MV_H) && (top > TA_VOLTAGE_MV_L))
+    LocalRegistersSetWord(TA_VOLTAGE_MV_L, g_voltage_mv);
+  if ((register_id < TA_HEALTH_FAIL_MAP + HEALTH_FAIL_MAP_SIZE) && (top > TA_HEALTH_FAILING_COUNT))
+    ServoHealthUpdateRegisters();
+  if ((register_id <= TA_SYNC_READ_RETRY_MAX_US_H) && (top > TA_SYNC_READ_RETRY_COUNT_L))
+    SyncReadUpdateRegisters();
+  if ((register_id <= TA_BUS_RELEASE_MAX_US_H) && (top > TA_BUS_RELEASE_LAST_US_L))
+    AXBussUpdateRegisters();
+  if ((register_id <= TA_TRAJ_QUEUE_FREE) && (top > TA_TRAJ_ACTIVE))
+    TrajectoryUpdateRegisters();
+  if ((register_id <= TA_SHADOW_BYTES_H) && (top > TA_SHADOW_SUPPRESSED_L))
+    WriteShadowUpdateRegisters();
+}
+
+//-----------------------------------------------------------------------------
+// LocalRegistersSetWord - Store a 16 bit value low byte first, saturating
+//        anything that does not fit.
+//-----------------------------------------------------------------------------
+void LocalRegistersSetWord(uint8_t register_id, uint32_t value)
+{
+  if (value > 0xffff)
+    value = 0xffff;
+  g_controller_registers[register_id] = value & 0xff;
+  g_controller_registers[register_id + 1] = value >> 8;
 }
 
 //-----------------------------------------------------------------------------
@@ -173,18 +251,26 @@ void CheckHardwareForLocalReadRequest(uint8_t register_id, uint8_t count_bytes)
 uint8_t ValidateWriteData(uint8_t register_id, uint8_t* data, uint8_t count_bytes)
 {
   uint16_t top = (uint16_t)register_id + count_bytes;
-  if (count_bytes == 0  || ( top >= REG_TABLE_SIZE)) {
+  if (count_bytes == 0  || ( top > REG_TABLE_SIZE)) {
     return false;
   }
   // Check that the value written are acceptable
   for (uint8_t i = 0 ; i < count_bytes; i++ ) {
     uint8_t val = data[i];
-    if ((val < g_controller_registers_ranges[register_id][0] ) ||
-        (val > g_controller_registers_ranges[register_id][1] ))
+    if ((val < g_controller_registers_ranges[register_id + i][0] ) ||
+        (val > g_controller_registers_ranges[register_id + i][1] ))
     {
       return false;
     }
   }
+
+  // A keyframe we have no room for is refused now, before we answer the host
+  if ((register_id <= TA_TRAJ_COMMIT) && (top > TA_TRAJ_COMMIT) &&
+      (data[TA_TRAJ_COMMIT - register_id] == TRAJ_COMMIT_QUEUE)) {
+    uint8_t id = (register_id <= TA_TRAJ_ID) ? data[TA_TRAJ_ID - register_id] : g_controller_registers[TA_TRAJ_ID];
+    if (!TrajectoryCanQueue(id))
+      return false;
+  }
   return true;
 }
 
@@ -193,17 +279,52 @@ uint8_t ValidateWriteData(uint8_t register_id, uint8_t* data, uint8_t count_byte
 //-----------------------------------------------------------------------------
 void UpdateHardwareAfterLocalWrite(uint8_t register_id, uint8_t count_bytes)
 {
-#if 0
-  uint8_t i;
-  uint8_t mask;
-  while (count_bytes)
+  while (count_bytes--)
   {
     switch (register_id)
     {
+      case TA_HEALTH_CLEAR:
+        if (g_controller_registers[TA_HEALTH_CLEAR])
+          ServoHealthClear();
+        g_controller_registers[TA_HEALTH_CLEAR] = 0;
+        break;
+
+      case TA_SYNC_READ_MODE:
+      case TA_SYNC_READ_KEYFRAME:
+        // The host may not have seen our last delta, start again from a keyframe
+        SyncReadDeltaRestart();
+        break;
+
+      case TA_TRAJ_COMMIT:
+        TrajectoryCommit(g_controller_registers[TA_TRAJ_COMMIT]);
+        g_controller_registers[TA_TRAJ_COMMIT] = TRAJ_COMMIT_NONE;
+        break;
+
+      case TA_SHADOW_MODE:
+        // Start from nothing, we did not watch what was written while off
+        WriteShadowClear();
+        break;
+
+      case TA_SHADOW_CLEAR:
+        if (g_controller_registers[TA_SHADOW_CLEAR])
+          WriteShadowClear();
+        g_controller_registers[TA_SHADOW_CLEAR] = 0;
+        break;
+
+      case TA_BUS_RELEASE_CLEAR:
+        if (g_controller_registers[TA_BUS_RELEASE_CLEAR])
+          AXBussClearRelease();
+        g_controller_registers[TA_BUS_RELEASE_CLEAR] = 0;
+        break;
+
+      case TA_SYNC_READ_RETRY_CLEAR:
+        if (g_controller_registers[TA_SYNC_READ_RETRY_CLEAR])
+          SyncReadRetryClear();
+        g_controller_registers[TA_SYNC_READ_RETRY_CLEAR] = 0;
+        break;
     }
-    }
+    register_id++;
   }
-#endif  
 }
 
 
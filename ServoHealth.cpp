@@ -0,0 +1,104 @@
+//=============================================================================
+// File: ServoHealth.cpp
+//  Keep track of the error byte of every status packet we see from the
+//  servos, plus any servos that did not answer us, so the host can find a
+//  failing servo with one read of our registers instead of scanning the buss.
+//=============================================================================
+
+//=============================================================================
+// Header Files
+//=============================================================================
+#include <ax12Serial.h>
+#include <BioloidSerial.h>
+#include "globals.h"
+
+//-----------------------------------------------------------------------------
+// Define Global variables
+//-----------------------------------------------------------------------------
+typedef struct {
+  uint16_t replies;         // status packets seen
+  uint8_t  error_count;     // status packets with error bits set (saturates)
+  uint8_t  missed_count;    // times it did not answer us (saturates)
+  uint8_t  error_bits;      // all error bits seen since cleared, plus HEALTH_ERR_MISSED
+  uint8_t  last_error;
+  unsigned long last_seen;  // millis()
+} servo_health_t;
+
+servo_health_t g_servo_health[AX_ID_BROADCAST]; // IDs 0-253
+
+//-----------------------------------------------------------------------------
+// ServoHealthNoteStatus - We saw a status packet from a servo.
+//-----------------------------------------------------------------------------
+void ServoHealthNoteStatus(uint8_t id, uint8_t error)
+{
+  if (id >= AX_ID_BROADCAST)
+    return;
+  servo_health_t *psh = &g_servo_health[id];
+  if (psh->replies != 0xffff)
+    psh->replies++;
+  psh->last_seen = millis();
+  psh->last_error = error;
+  if (error) {
+    psh->error_bits |= error;
+    if (psh->error_count != 0xff)
+      psh->error_count++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// ServoHealthNoteMissed - A servo did not give us a valid answer.
+//-----------------------------------------------------------------------------
+void ServoHealthNoteMissed(uint8_t id)
+{
+  if (id >= AX_ID_BROADCAST)
+    return;
+  servo_health_t *psh = &g_servo_health[id];
+  psh->error_bits |= HEALTH_ERR_MISSED;
+  if (psh->missed_count != 0xff)
+    psh->missed_count++;
+}
+
+//-----------------------------------------------------------------------------
+// ServoHealthClear - Start counting over.
+//-----------------------------------------------------------------------------
+void ServoHealthClear(void)
+{
+  memset(g_servo_health, 0, sizeof(g_servo_health));
+}
+
+//-----------------------------------------------------------------------------
+// ServoHealthUpdateRegisters - Build the summary in the register table when
+//    the host asks for it.  Nothing here is done on the packet path.
+//-----------------------------------------------------------------------------
+void ServoHealthUpdateRegisters(void)
+{
+  uint8_t failing = 0;
+  uint8_t worst_id = 0xff;
+  uint16_t worst_count = 0;
+  uint8_t all_errors = 0;
+
+  memset(&g_controller_registers[TA_HEALTH_FAIL_MAP], 0, HEALTH_FAIL_MAP_SIZE);
+  for (uint8_t id = 0; id < AX_ID_BROADCAST; id++) {
+    servo_health_t *psh = &g_servo_health[id];
+    if (psh->error_bits) {
+      failing++;
+      all_errors |= psh->error_bits;
+      g_controller_registers[TA_HEALTH_FAIL_MAP + (id >> 3)] |= 1 << (id & 7);
+      uint16_t count = psh->error_count + psh->missed_count;
+      if (count > worst_count) {
+        worst_count = count;
+        worst_id = id;
+      }
+    }
+  }
+  g_controller_registers[TA_HEALTH_FAILING_COUNT] = failing;
+  g_controller_registers[TA_HEALTH_WORST_ID] = worst_id;
+  g_controller_registers[TA_HEALTH_ALL_ERRORS] = all_errors;
+
+  // Details for the servo the host selected
+  servo_health_t *psh = &g_servo_health[g_controller_registers[TA_HEALTH_DETAIL_ID]];
+  g_controller_registers[TA_HEALTH_DETAIL_ERRORS] = psh->error_bits;
+  g_controller_registers[TA_HEALTH_DETAIL_ERROR_COUNT] = psh->error_count;
+  g_controller_registers[TA_HEALTH_DETAIL_MISSED_COUNT] = psh->missed_count;
+  LocalRegistersSetWord(TA_HEALTH_DETAIL_AGE_L, psh->replies ? (uint32_t)(millis() - psh->last_seen) : 0xffff);  // saturates
+}
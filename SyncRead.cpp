@@ -14,6 +14,214 @@
 //-----------------------------------------------------------------------------
 // Define Global variables
 //-----------------------------------------------------------------------------
+uint8_t g_sync_read_errors[AX_SYNC_READ_MAX_DEVICES];   // error byte from each servo
+uint8_t g_sync_read_latency[AX_SYNC_READ_MAX_DEVICES];  // x 10us, 0xff if no answer
+
+// Delta mode, what we last sent the host
+uint8_t g_sync_read_delta_cache[SYNC_READ_DELTA_CACHE_SIZE];
+uint8_t g_sync_read_delta_request[AX_SYNC_READ_MAX_DEVICES + 2]; // addr, length, ids
+uint8_t g_sync_read_delta_request_len = 0;
+uint8_t g_sync_read_delta_seq = 0;
+uint8_t g_sync_read_since_keyframe = 0;
+
+// Retry statistics
+uint16_t g_sync_read_retry_count = 0;
+uint16_t g_sync_read_retry_good = 0;
+uint32_t g_sync_read_retry_last_us = 0;
+uint32_t g_sync_read_retry_max_us = 0;
+
+//-----------------------------------------------------------------------------
+// SyncReadExtraBytes - How many bytes the extended reply adds to the normal
+//    sync read reply, with the current TA_SYNC_READ_MODE.
+//-----------------------------------------------------------------------------
+uint16_t SyncReadExtraBytes(uint8_t nb_servos)
+{
+  uint8_t mode = g_controller_registers[TA_SYNC_READ_MODE];
+  uint16_t extra = 0;
+  if (mode & SYNC_READ_MODE_STATUS)
+    extra += (nb_servos + 7) / 8;
+  if (mode & SYNC_READ_MODE_ERRORS)
+    extra += nb_servos;
+  if (mode & SYNC_READ_MODE_LATENCY)
+    extra += nb_servos;
+  if (mode & SYNC_READ_MODE_DELTA)
+    extra += SYNC_READ_DELTA_HEADER + (nb_servos + 7) / 8;
+  return extra;
+}
+
+//-----------------------------------------------------------------------------
+// SyncReadDeltaKeyframe - Decide if this sync read needs a keyframe: the host
+//    asked for something different, it is too big to remember, or it is time.
+//-----------------------------------------------------------------------------
+bool SyncReadDeltaKeyframe(uint8_t* params, uint8_t nb_params)
+{
+  uint8_t interval = g_controller_registers[TA_SYNC_READ_KEYFRAME];
+  if (!interval)
+    interval = SYNC_READ_KEYFRAME_DEFAULT;
+
+  bool keyframe = (nb_params != g_sync_read_delta_request_len)
+                  || memcmp(params, g_sync_read_delta_request, nb_params)
+                  || ((uint16_t)params[1] * (nb_params - 2) > SYNC_READ_DELTA_CACHE_SIZE)
+                  || (++g_sync_read_since_keyframe >= interval);
+  if (keyframe) {
+    memcpy(g_sync_read_delta_request, params, nb_params);
+    g_sync_read_delta_request_len = nb_params;
+    g_sync_read_since_keyframe = 0;
+  }
+  return keyframe;
+}
+
+//-----------------------------------------------------------------------------
+// SyncReadDeltaRestart - Forget the last request, so the next delta sync read
+//    is a keyframe.  Called when the host changes the mode or the interval.
+//-----------------------------------------------------------------------------
+void SyncReadDeltaRestart(void)
+{
+  g_sync_read_delta_request_len = 0;
+}
+
+//-----------------------------------------------------------------------------
+// SyncReadDeltaEncode - The slots for servos first..first+count-1 are at
+//    pb + header + bitmap.  Fill in the header and bitmap, and squeeze out the
+//    slots that did not change.  Returns the bytes used.
+//-----------------------------------------------------------------------------
+uint8_t SyncReadDeltaEncode(uint8_t* pb, uint8_t first, uint8_t count, uint8_t nb_to_read, bool keyframe)
+{
+  uint8_t bitmap_size = (count + 7) / 8;
+  uint8_t* bitmap = pb + SYNC_READ_DELTA_HEADER;
+  uint8_t* slot = bitmap + bitmap_size;
+  uint8_t* out = slot;
+  bool cached = ((uint16_t)nb_to_read * (first + count)) <= SYNC_READ_DELTA_CACHE_SIZE;
+
+  pb[0] = g_sync_read_delta_seq;
+  pb[1] = keyframe ? SYNC_READ_DELTA_KEYFRAME : 0;
+  pb[2] = first;
+  pb[3] = count;
+  memset(bitmap, 0, bitmap_size);
+  for (uint8_t i = 0; i < count; i++, slot += nb_to_read) {
+    uint8_t* cache = &g_sync_read_delta_cache[(first + i) * nb_to_read];
+    if (keyframe || !cached || memcmp(slot, cache, nb_to_read)) {
+      bitmap[i >> 3] |= 1 << (i & 7);
+      if (cached)
+        memcpy(cache, slot, nb_to_read);
+      if (out != slot)
+        memmove(out, slot, nb_to_read);
+      out += nb_to_read;
+    }
+  }
+  return out - pb;
+}
+
+//-----------------------------------------------------------------------------
+// SyncReadServo: Ask one servo for its registers.  Returns true if we got
+//    a valid answer, in which case the data is in ax_rx_buffer[5]...
+//-----------------------------------------------------------------------------
+bool SyncReadServo(uint8_t id, uint8_t addr, uint8_t nb_to_read, uint8_t *perror, uint8_t *platency)
+{
+  unsigned long start_time = micros();
+  setTX(id);
+  // 0xFF 0xFF ID LENGTH INSTRUCTION PARAM... CHECKSUM
+  int checksum_out = ~((id + 6 + addr + nb_to_read) % 256);
+  ax12writeB(0xFF);
+  ax12writeB(0xFF);
+  ax12writeB(id);
+  ax12writeB(4);    // length
+  ax12writeB(AX_READ_DATA);
+  ax12writeB(addr);
+  ax12writeB(nb_to_read);
+  ax12writeB(checksum_out);
+
+  setRX(id);
+  if (ax12ReadPacket(nb_to_read + 6) > 0) {
+    // Make sure it is the servo we asked and the data made it here intact
+    uint8_t checksum = 0;
+    for (uint8_t i = 2; i < nb_to_read + 5; i++)
+      checksum += ax_rx_buffer[i];
+    if ((ax_rx_buffer[2] == id) && ((uint8_t)~checksum == ax_rx_buffer[nb_to_read + 5])) {
+      uint32_t latency = (micros() - start_time) / 10;
+      *platency = (latency < 0xff) ? latency : 0xfe;
+      *perror = ax_rx_buffer[4];
+      ServoHealthNoteStatus(id, *perror);
+      if (*perror)
+        WriteShadowInvalidate(id);
+      else
+        WriteShadowNoteRead(id, addr, &ax_rx_buffer[5], nb_to_read);
+      return true;
+    }
+  }
+  *platency = 0xff;
+  *perror = HEALTH_ERR_MISSED;
+  ServoHealthNoteMissed(id);
+  WriteShadowInvalidate(id);
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// SyncReadServosPerSegment - How many servos fit in one status packet with
+//    the current TA_SYNC_READ_MODE, used when we segment the reply.
+//-----------------------------------------------------------------------------
+uint8_t SyncReadServosPerSegment(uint8_t nb_to_read)
+{
+  uint8_t nb_servos = 0;
+  while ((nb_servos < AX_SYNC_READ_MAX_DEVICES)
+         && (((uint16_t)nb_to_read * (nb_servos + 1) + SyncReadExtraBytes(nb_servos + 1))
+             <= (AX_MAX_RETURN_PACKET_SIZE - 6)))
+    nb_servos++;
+  return nb_servos;
+}
+
+//-----------------------------------------------------------------------------
+// SyncReadServoRange - Read a range of servos into data, one slot each, and
+//    then retry the ones that failed while the retry budget and deadline
+//    allow.
+//-----------------------------------------------------------------------------
+void SyncReadServoRange(uint8_t* servos, uint8_t first, uint8_t count, uint8_t addr, uint8_t nb_to_read,
+                        uint8_t* data, uint8_t &retries_left, unsigned long start_time)
+{
+  uint8_t failed_count = 0;
+  for (uint8_t servo_index = first; servo_index < first + count; servo_index++) {
+    uint8_t* slot = &data[(servo_index - first) * nb_to_read];
+    if (SyncReadServo(servos[servo_index], addr, nb_to_read,
+                      &g_sync_read_errors[servo_index], &g_sync_read_latency[servo_index])) {
+      memcpy(slot, &ax_rx_buffer[5], nb_to_read);
+#ifdef DBGSerial
+      for (uint8_t i = 0; i < nb_to_read; i++) {
+        DBGSerial.print(ax_rx_buffer[i + 5] , HEX);
+        DBGSerial.print(" ");
+      }
+#endif
+    } else {
+      memset(slot, 0xFF, nb_to_read);
+      failed_count++;
+    }
+  }
+
+  // Give the servos that did not answer, or answered garbage, another chance
+  // now, it is a lot cheaper than the host redoing the whole sync read.
+  uint32_t deadline_us = (uint32_t)g_controller_registers[TA_SYNC_READ_DEADLINE] * 100;
+  while (failed_count && retries_left) {
+    for (uint8_t servo_index = first; servo_index < first + count; servo_index++) {
+      if (g_sync_read_latency[servo_index] != 0xff)
+        continue;
+      unsigned long retry_start = micros();
+      if (!retries_left || (deadline_us && ((retry_start - start_time) >= deadline_us))) {
+        retries_left = 0;
+        break;
+      }
+      retries_left--;
+      g_sync_read_retry_count++;
+      if (SyncReadServo(servos[servo_index], addr, nb_to_read,
+                        &g_sync_read_errors[servo_index], &g_sync_read_latency[servo_index])) {
+        memcpy(&data[(servo_index - first) * nb_to_read], &ax_rx_buffer[5], nb_to_read);
+        g_sync_read_retry_good++;
+        failed_count--;
+      }
+      g_sync_read_retry_last_us = micros() - retry_start;
+      if (g_sync_read_retry_last_us > g_sync_read_retry_max_us)
+        g_sync_read_retry_max_us = g_sync_read_retry_last_us;
+    }
+  }
+}
 
 //-----------------------------------------------------------------------------
 // sync_read: this handles the sync read message and loops through each of the
@@ -21,6 +229,13 @@
 // one usb message.
 // Note: we pass through the ID as the other side validation will look to
 // make sure it matches...
+// If TA_SYNC_READ_MODE asks for it, we append which servos did not answer
+// and their error bytes and latencies after the data.
+// In delta mode only the servo slots that changed since the last reply are
+// sent, see SyncReadDeltaEncode, with a keyframe now and then to resync.
+// In segmented mode the reply is split into as many status packets as needed,
+// each holding whole servo slots, and each one is sent as soon as it is
+// filled.  All but the last have SYNC_READ_MORE_SEGMENTS set in the error byte.
 //-----------------------------------------------------------------------------
 void sync_read(uint8_t id, uint8_t* params, uint8_t nb_params) {
 
@@ -30,79 +245,94 @@ void sync_read(uint8_t id, uint8_t* params, uint8_t nb_params) {
   uint8_t addr = params[0];    // address to read in control table
   uint8_t nb_to_read = params[1];    // # of bytes to read from each servo
   uint8_t nb_servos = nb_params - 2;
-
-#ifdef BUFFER_TO_USB
-  g_abToUSBCnt = 0;
-  g_abToUSBBuffer[g_abToUSBCnt++] = (0xff);
-  g_abToUSBBuffer[g_abToUSBCnt++] = (0xff);
-  g_abToUSBBuffer[g_abToUSBCnt++] = (id);
-  g_abToUSBBuffer[g_abToUSBCnt++] = (2 + (nb_to_read * nb_servos));
-  g_abToUSBBuffer[g_abToUSBCnt++] = ((uint8_t)0);  //error code
-#else
-  PCSerial.write(0xff);
-  PCSerial.write(0xff);
-  PCSerial.write(id);
-  PCSerial.write(2 + (nb_to_read * nb_servos));
-  PCSerial.write((uint8_t)0);  //error code
-#endif
-  // get ax data
-  uint8_t checksum = id + (nb_to_read * nb_servos) + 2; // start accumulating the checksum
   uint8_t* servos = params + 2; // pointer to the ids of the servos to read from
-  for (uint8_t servo_id = 0; servo_id < nb_servos; servo_id++) {
-    uint8_t id = servos[servo_id];
-    setTX(id);
-    // 0xFF 0xFF ID LENGTH INSTRUCTION PARAM... CHECKSUM
-    int checksum_out = ~((id + 6 + addr + nb_to_read) % 256);
-    ax12writeB(0xFF);
-    ax12writeB(0xFF);
-    ax12writeB(id);
-    ax12writeB(4);    // length
-    ax12writeB(AX_READ_DATA);
-    ax12writeB(addr);
-    ax12writeB(nb_to_read);
-    ax12writeB(checksum_out);
-
-    setRX(id);
-    if (ax12ReadPacket(nb_to_read + 6) > 0) {
-      for (uint8_t i = 0; i < nb_to_read; i++) {
-        uint8_t b = ax_rx_buffer[i + 5];
-        checksum += b ;
-#ifdef BUFFER_TO_USB
-        g_abToUSBBuffer[g_abToUSBCnt++] = b;
-#else
-        PCSerial.write(b);
-#endif
-#ifdef DBGSerial
-        DBGSerial.print(b , HEX);
-        DBGSerial.print(" ");
-#endif
-      }
-    } else {
-      for (uint8_t i = 0; i < nb_to_read; i++) {
-        checksum += 0xFF;
-#ifdef BUFFER_TO_USB
-        g_abToUSBBuffer[g_abToUSBCnt++] = 0xFF;
-#else
-        PCSerial.write(0xFF);
-#endif
+  uint8_t mode = g_controller_registers[TA_SYNC_READ_MODE];
+  uint8_t per_segment = (mode & SYNC_READ_MODE_SEGMENTED) ? SyncReadServosPerSegment(nb_to_read) : nb_servos;
+
+  unsigned long start_time = micros();
+  uint8_t retries_left = g_controller_registers[TA_SYNC_READ_RETRIES];
+  bool keyframe = false;
+  if (mode & SYNC_READ_MODE_DELTA) {
+    keyframe = SyncReadDeltaKeyframe(params, nb_params);
+    g_sync_read_delta_seq++;
+  }
+
+  uint8_t first = 0;
+  do {
+    uint8_t count = min(per_segment, (uint8_t)(nb_servos - first));
+    bool more_segments = (first + count) < nb_servos;
+
+    g_abToUSBCnt = 0;
+    g_abToUSBBuffer[g_abToUSBCnt++] = (0xff);
+    g_abToUSBBuffer[g_abToUSBCnt++] = (0xff);
+    g_abToUSBBuffer[g_abToUSBCnt++] = (id);
+    g_abToUSBBuffer[g_abToUSBCnt++] = 0;   // length, filled in once we know it
+    g_abToUSBBuffer[g_abToUSBCnt++] = more_segments ? SYNC_READ_MORE_SEGMENTS : 0;  //error code
+
+    // get ax data, in delta mode leave room for the delta header and bitmap
+    uint8_t data_offset = (mode & SYNC_READ_MODE_DELTA) ? SYNC_READ_DELTA_HEADER + (count + 7) / 8 : 0;
+    SyncReadServoRange(servos, first, count, addr, nb_to_read, &g_abToUSBBuffer[g_abToUSBCnt + data_offset],
+                       retries_left, start_time);
+    if (mode & SYNC_READ_MODE_DELTA)
+      g_abToUSBCnt += SyncReadDeltaEncode(&g_abToUSBBuffer[g_abToUSBCnt], first, count, nb_to_read, keyframe);
+    else
+      g_abToUSBCnt += nb_to_read * count;
+
+    // Now add on any of the extended information asked for.
+    if (mode & SYNC_READ_MODE_STATUS) {
+      memset(&g_abToUSBBuffer[g_abToUSBCnt], 0, (count + 7) / 8);
+      for (uint8_t i = 0; i < count; i++) {
+        if (g_sync_read_latency[first + i] == 0xff)
+          g_abToUSBBuffer[g_abToUSBCnt + (i >> 3)] |= 1 << (i & 7);
       }
+      g_abToUSBCnt += (count + 7) / 8;
+    }
+    if (mode & SYNC_READ_MODE_ERRORS) {
+      memcpy(&g_abToUSBBuffer[g_abToUSBCnt], &g_sync_read_errors[first], count);
+      g_abToUSBCnt += count;
+    }
+    if (mode & SYNC_READ_MODE_LATENCY) {
+      memcpy(&g_abToUSBBuffer[g_abToUSBCnt], &g_sync_read_latency[first], count);
+      g_abToUSBCnt += count;
     }
-  }
 
-#ifdef BUFFER_TO_USB
-  g_abToUSBBuffer[g_abToUSBCnt++] = (255 - ((checksum) % 256));
-  PCSerial.write(g_abToUSBBuffer, g_abToUSBCnt);
+    g_abToUSBBuffer[3] = g_abToUSBCnt - 3;  // error byte, parameters and checksum
+    uint8_t checksum = 0;
+    for (uint8_t i = 2; i < g_abToUSBCnt; i++)
+      checksum += g_abToUSBBuffer[i];
+    g_abToUSBBuffer[g_abToUSBCnt++] = (255 - checksum);
+    PCSerial.write(g_abToUSBBuffer, g_abToUSBCnt);
 
-#else
-  PCSerial.write(255 - ((checksum) % 256));
-#endif
 #ifdef DBGSerial
-  DBGSerial.println("SF");
+    DBGSerial.println("SF");
 #endif
-  PCSerial.flush();
+    PCSerial.flush();
+    first += count;
+  } while (first < nb_servos);
 
   // allow data from USART to be sent directly to USB
   g_passthrough_mode = AX_PASSTHROUGH;
 }
 
+//-----------------------------------------------------------------------------
+// SyncReadRetryClear - Host wrote TA_SYNC_READ_RETRY_CLEAR.
+//-----------------------------------------------------------------------------
+void SyncReadRetryClear(void)
+{
+  g_sync_read_retry_count = 0;
+  g_sync_read_retry_good = 0;
+  g_sync_read_retry_last_us = 0;
+  g_sync_read_retry_max_us = 0;
+}
 
+//-----------------------------------------------------------------------------
+// SyncReadUpdateRegisters - Copy the retry statistics into the register table
+//    when the host asks for them.
+//-----------------------------------------------------------------------------
+void SyncReadUpdateRegisters(void)
+{
+  LocalRegistersSetWord(TA_SYNC_READ_RETRY_COUNT_L, g_sync_read_retry_count);
+  LocalRegistersSetWord(TA_SYNC_READ_RETRY_GOOD_L, g_sync_read_retry_good);
+  LocalRegistersSetWord(TA_SYNC_READ_RETRY_LAST_US_L, g_sync_read_retry_last_us);
+  LocalRegistersSetWord(TA_SYNC_READ_RETRY_MAX_US_L, g_sync_read_retry_max_us);
+}
@@ -65,7 +65,14 @@ void setup()
 #endif
   PCSerial.begin(baud);	// USB, communication to PC or Mac
   ax12Init(1000000, &HWSERIAL, SERVO_DIRECTION_PIN);
+#ifdef AX_TX_COMPLETE_TURNAROUND
+  // Have the Serial code switch TXDIR itself, on write and on transmit complete
+  HWSERIAL.begin(1000000, SERIAL_8N1 | SERIAL_HALF_DUPLEX);
+#endif
   
+  BusSchedulerInit();
+  BatteryMonitorInit();
+  TrajectoryInit();
   setAXtoTX();
   InitalizeRegisterTable(); 
 
@@ -101,6 +108,19 @@ void loop()
   debug_digitalWrite( DEBUG_PIN_AX_INPUT,  LOW);
 //  yield();
 
+  // A servo that did not answer may have rebooted, forget what we wrote it
+  WriteShadowCheckTimeout();
+
+  // Queue up the next trajectory SYNC_WRITE when it is time
+  CheckTrajectories();
+
+  // If the host left us a big enough gap, let any of our own buss work run
+  if (!did_something)
+    did_something = BusSchedulerRun();
+
+  // Voltage is sampled by a timer, this only acts on a low voltage it found
+  CheckBatteryVoltage();
+
   // If we did not process any data input from USB or from AX Buss, maybe we should flush anything we have 
   // pending to go back to main processor
 #if 0
@@ -0,0 +1,252 @@
+//=============================================================================
+// File: Trajectory.cpp
+//  Move servos through keyframes on our own, so the host only needs to send
+//  the keyframes instead of streaming goal positions.  Every tick we work out
+//  where each moving servo should be and send all of them in one SYNC_WRITE.
+//
+//  The host writes a keyframe into TA_TRAJ_ID..TA_TRAJ_COMMIT in one
+//  WRITE_DATA: servo ID, goal position, how many ms to take to get there from
+//  the previous keyframe, the shape, and TRAJ_COMMIT_QUEUE.  We do not know
+//  where a servo is when it starts, so the first keyframe of a servo should
+//  have a time of 0 to give us the starting point.  A keyframe that does not
+//  fit (queue full, or no free slot for a new servo) gets ERR_RANGE.
+//=============================================================================
+
+//=============================================================================
+// Header Files
+//=============================================================================
+#include <ax12Serial.h>
+#include <BioloidSerial.h>
+#include "globals.h"
+
+//-----------------------------------------------------------------------------
+// Define Global variables
+//-----------------------------------------------------------------------------
+typedef struct {
+  uint16_t goal;
+  uint16_t duration_ms;
+  uint8_t  shape;
+} traj_keyframe_t;
+
+typedef struct {
+  uint8_t  id;                // 0xff - slot not used
+  uint8_t  queue_count;
+  uint8_t  queue_head;
+  uint16_t start_pos;         // where the current segment started
+  uint16_t pos;               // last position we sent
+  unsigned long start_time;   // millis() the current segment started
+  traj_keyframe_t queue[TRAJ_QUEUE_SIZE];
+} traj_servo_t;
+
+traj_servo_t g_traj_servos[TRAJ_MAX_SERVOS];
+bool g_traj_tick_queued = false;
+unsigned long g_traj_last_tick;
+
+//-----------------------------------------------------------------------------
+// TrajectoryInit
+//-----------------------------------------------------------------------------
+void TrajectoryInit(void)
+{
+  for (uint8_t i = 0; i < TRAJ_MAX_SERVOS; i++) {
+    g_traj_servos[i].id = 0xff;
+    g_traj_servos[i].queue_count = 0;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// TrajectoryFindServo - Find the slot for a servo, optionally grabbing a
+//    free one.
+//-----------------------------------------------------------------------------
+traj_servo_t *TrajectoryFindServo(uint8_t id, bool allocate)
+{
+  traj_servo_t *pfree = NULL;
+  for (uint8_t i = 0; i < TRAJ_MAX_SERVOS; i++) {
+    if (g_traj_servos[i].id == id)
+      return &g_traj_servos[i];
+    if ((g_traj_servos[i].id == 0xff) && !pfree)
+      pfree = &g_traj_servos[i];
+  }
+  if (allocate && pfree) {
+    pfree->id = id;
+    pfree->queue_count = 0;
+    pfree->queue_head = 0;
+    pfree->pos = TRAJ_POS_UNKNOWN;
+    return pfree;
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// TrajectoryCanQueue - Is there room for one more keyframe for this servo,
+//    either in its queue or in a free slot.
+//-----------------------------------------------------------------------------
+bool TrajectoryCanQueue(uint8_t id)
+{
+  traj_servo_t *pts = TrajectoryFindServo(id, false);
+  if (pts)
+    return pts->queue_count < TRAJ_QUEUE_SIZE;
+  return TrajectoryFindServo(0xff, false) != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// TrajectoryCommit - Host wrote TA_TRAJ_COMMIT.  A keyframe that does not fit
+//    was already refused with ERR_RANGE by ValidateWriteData.
+//-----------------------------------------------------------------------------
+void TrajectoryCommit(uint8_t command)
+{
+  uint8_t id = g_controller_registers[TA_TRAJ_ID];
+  traj_servo_t *pts;
+
+  switch (command) {
+    case TRAJ_COMMIT_QUEUE:
+      pts = TrajectoryFindServo(id, true);
+      if (pts && (pts->queue_count < TRAJ_QUEUE_SIZE)) {
+        traj_keyframe_t *pkf = &pts->queue[(pts->queue_head + pts->queue_count) % TRAJ_QUEUE_SIZE];
+        pkf->goal = g_controller_registers[TA_TRAJ_GOAL_L] + (g_controller_registers[TA_TRAJ_GOAL_H] << 8);
+        pkf->duration_ms = g_controller_registers[TA_TRAJ_TIME_L] + (g_controller_registers[TA_TRAJ_TIME_H] << 8);
+        pkf->shape = g_controller_registers[TA_TRAJ_SHAPE];
+        if (!pts->queue_count++) {
+          // Nothing was moving, so this segment starts now from where we last left it
+          pts->start_pos = (pts->pos == TRAJ_POS_UNKNOWN) ? pkf->goal : pts->pos;
+          pts->start_time = millis();
+        }
+      }
+      break;
+
+    case TRAJ_COMMIT_STOP:
+      pts = TrajectoryFindServo(id, false);
+      if (pts)
+        pts->id = 0xff;
+      break;
+
+    case TRAJ_COMMIT_STOP_ALL:
+      TrajectoryInit();
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// TrajectoryPosition - Where a servo should be now, moves on to the next
+//    keyframe when it finishes one.
+//-----------------------------------------------------------------------------
+uint16_t TrajectoryPosition(traj_servo_t *pts, unsigned long cur_time)
+{
+  for (;;) {
+    traj_keyframe_t *pkf = &pts->queue[pts->queue_head];
+    uint32_t elapsed = cur_time - pts->start_time;
+    if (elapsed < pkf->duration_ms) {
+      // t and s are 0-1 in 16.16 fixed point
+      uint32_t t = (elapsed << 16) / pkf->duration_ms;
+      uint32_t s = t;
+      if (pkf->shape == TRAJ_SHAPE_SMOOTH) {
+        uint32_t t2 = (t * t) >> 16;
+        uint32_t t3 = (t2 * t) >> 16;
+        s = 3 * t2 - 2 * t3;
+      }
+      return pts->start_pos + (((int32_t)pkf->goal - (int32_t)pts->start_pos) * (int32_t)s >> 16);
+    }
+
+    // Finished this keyframe, the next one starts exactly when this one ended
+    pts->start_pos = pkf->goal;
+    pts->start_time += pkf->duration_ms;
+    pts->queue_head = (pts->queue_head + 1) % TRAJ_QUEUE_SIZE;
+    if (!--pts->queue_count)
+      return pkf->goal;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// TrajectoryTick - Runs from the buss scheduler, send all the moving servos
+//    their new goal positions in one SYNC_WRITE.
+//-----------------------------------------------------------------------------
+void TrajectoryTick(void)
+{
+  uint8_t ids[TRAJ_MAX_SERVOS];
+  uint16_t positions[TRAJ_MAX_SERVOS];
+  uint8_t count = 0;
+  unsigned long cur_time = millis();
+
+  g_traj_tick_queued = false;
+  g_traj_last_tick = cur_time;
+  for (uint8_t i = 0; i < TRAJ_MAX_SERVOS; i++) {
+    traj_servo_t *pts = &g_traj_servos[i];
+    if ((pts->id == 0xff) || !pts->queue_count)
+      continue;
+    pts->pos = TrajectoryPosition(pts, cur_time);
+    ids[count] = pts->id;
+    positions[count++] = pts->pos;
+  }
+  if (!count)
+    return;
+
+  // 0xFF 0xFF 0xFE LENGTH SYNC_WRITE ADDR LEN (ID L H)... CHECKSUM
+  uint8_t length = 3 * count + 4;
+  uint8_t checksum = AX_ID_BROADCAST + length + AX_SYNC_WRITE + AX_GOAL_POSITION_L + 2;
+  setAXtoTX();
+  ax12writeB(0xFF);
+  ax12writeB(0xFF);
+  ax12writeB(AX_ID_BROADCAST);
+  ax12writeB(length);
+  ax12writeB(AX_SYNC_WRITE);
+  ax12writeB(AX_GOAL_POSITION_L);
+  ax12writeB(2);
+  for (uint8_t i = 0; i < count; i++) {
+    ax12writeB(ids[i]);
+    ax12writeB(positions[i] & 0xff);
+    ax12writeB(positions[i] >> 8);
+    checksum += ids[i] + (positions[i] & 0xff) + (positions[i] >> 8);
+    uint8_t goal[2] = {(uint8_t)(positions[i] & 0xff), (uint8_t)(positions[i] >> 8)};
+    WriteShadowNoteWrite(ids[i], AX_GOAL_POSITION_L, goal, 2);
+  }
+  ax12writeB(~checksum);
+  AXBussNoteQueued();
+}
+
+//-----------------------------------------------------------------------------
+// CheckTrajectories - Called from the main loop, when it is time for the next
+//    tick, ask the buss scheduler for a gap.
+//-----------------------------------------------------------------------------
+void CheckTrajectories(void)
+{
+  if (!g_controller_registers[TA_TRAJ_ENABLE] || g_traj_tick_queued)
+    return;
+  uint8_t period = g_controller_registers[TA_TRAJ_PERIOD];
+  if (!period)
+    period = TRAJ_PERIOD_DEFAULT;
+  unsigned long cur_time = millis();
+  if ((cur_time - g_traj_last_tick) < period)
+    return;
+
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < TRAJ_MAX_SERVOS; i++) {
+    if ((g_traj_servos[i].id != 0xff) && g_traj_servos[i].queue_count)
+      count++;
+  }
+  if (!count)
+    return;
+
+  // At 1mbs each byte takes 10us on the wire
+  // g_traj_last_tick is set when the tick runs, it may wait a while for a gap
+  if (BusSchedulerQueue(TrajectoryTick, (3 * count + 8) * 10))
+    g_traj_tick_queued = true;
+}
+
+//-----------------------------------------------------------------------------
+// TrajectoryUpdateRegisters - Fill in the status registers when the host
+//    asks for them.
+//-----------------------------------------------------------------------------
+void TrajectoryUpdateRegisters(void)
+{
+  uint8_t active = 0;
+  for (uint8_t i = 0; i < TRAJ_MAX_SERVOS; i++) {
+    if ((g_traj_servos[i].id != 0xff) && g_traj_servos[i].queue_count)
+      active++;
+  }
+  g_controller_registers[TA_TRAJ_ACTIVE] = active;
+
+  traj_servo_t *pts = TrajectoryFindServo(g_controller_registers[TA_TRAJ_ID], false);
+  if (pts)
+    g_controller_registers[TA_TRAJ_QUEUE_FREE] = TRAJ_QUEUE_SIZE - pts->queue_count;
+  else
+    g_controller_registers[TA_TRAJ_QUEUE_FREE] = TrajectoryFindServo(0xff, false) ? TRAJ_QUEUE_SIZE : 0;
+}
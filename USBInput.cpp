@@ -20,6 +20,17 @@ uint16_t ax_checksum = 0;
 //-----------------------------------------------------------------------------
 extern void pass_bytes(uint8_t nb_bytes);
 
+//-----------------------------------------------------------------------------
+// NoteHostPacketSent - Tell the buss scheduler we finished passing a packet
+//  from the host to the servos, and if a servo will be answering it.
+//-----------------------------------------------------------------------------
+void NoteHostPacketSent(void) {
+  if (rxbyte[PACKET_ID] != AX_ID_BROADCAST) {
+    BusSchedulerNoteHostPacket(((rxbyte[PACKET_INSTRUCTION] == AX_READ_DATA) || (rxbyte[PACKET_INSTRUCTION] == AX_PING)) ?
+                               BUS_PRIORITY_HOST_READ : BUS_PRIORITY_HOST_WRITE);
+  }
+}
+
 //-----------------------------------------------------------------------------
 // passBufferedDataToServos - take any data that we read in and now output the
 // data over the AX Buss. 
@@ -49,6 +60,7 @@ void pass_bytes(uint8_t nb_bytes) {
     for (uint8_t i = 0; i < nb_bytes; i++) {
       ax12writeB(rxbyte[i]);
     }
+    AXBussNoteQueued();
   }
 }
 //-----------------------------------------------------------------------------
@@ -74,6 +86,7 @@ bool ProcessInputFromUSB(void)
         } else {
           setAXtoTX();
           ax12writeB(ch);
+          AXBussNoteQueued();
         }
         break;
 
@@ -95,7 +108,9 @@ bool ProcessInputFromUSB(void)
           ax_state = PACKET_LENGTH;
 
           // Check to see if we should start sending out the data here.  
-          if (rxbyte[PACKET_ID] != g_controller_registers[CM730_ID] && rxbyte[PACKET_ID] != AX_ID_BROADCAST ) {
+          // With the write shadow on we hold on to it until we see the length.
+          if (rxbyte[PACKET_ID] != g_controller_registers[CM730_ID] && rxbyte[PACKET_ID] != AX_ID_BROADCAST
+              && !g_controller_registers[TA_SHADOW_MODE]) {
             pass_bytes(rxbyte_count);
           }
         }
@@ -110,9 +125,17 @@ bool ProcessInputFromUSB(void)
             axStatusPacket(ERR_RANGE, NULL, 0);
             passBufferedDataToServos();
           }
+        } else if (g_controller_registers[TA_SHADOW_MODE]) {
+          if ((ch > 1) && (ch <= SHADOW_MAX_PACKET_LENGTH)) {
+            ax_state = AX_SHADOW_WRITE;   // short packet, get all of it before deciding
+          } else {
+            pass_bytes(rxbyte_count);     // the header we held on to
+            ax_state = AX_PASS_TO_SERVOS;
+          }
         } else {
           setAXtoTX();
           ax12writeB(ch);
+          AXBussNoteQueued();
           ax_state = AX_PASS_TO_SERVOS;
         }
         break;
@@ -135,6 +158,10 @@ bool ProcessInputFromUSB(void)
             passBufferedDataToServos();
           }
         } else {
+          // Broadcast, we won't see the rest of it so can't know what it changes
+          if (g_controller_registers[TA_SHADOW_MODE] && (rxbyte[PACKET_INSTRUCTION] != AX_PING)
+              && (rxbyte[PACKET_INSTRUCTION] != AX_READ_DATA))
+            WriteShadowClear();
           passBufferedDataToServos();
         }
         break;
@@ -162,7 +189,10 @@ bool ProcessInputFromUSB(void)
               uint8_t packet_overhead = 6;
               if ( (rxbyte[SYNC_READ_LENGTH] == 0)
                    || (rxbyte[SYNC_READ_LENGTH] > AX_BUFFER_SIZE - packet_overhead) // the return packets from the servos must fit the return buffer
-                   || ( (int16_t)rxbyte[SYNC_READ_LENGTH] * nb_servos_to_read > AX_MAX_RETURN_PACKET_SIZE - packet_overhead )) { // and the return packet to the host must not be bigger either
+                   || ((g_controller_registers[TA_SYNC_READ_MODE] & SYNC_READ_MODE_SEGMENTED) ?
+                       (SyncReadServosPerSegment(rxbyte[SYNC_READ_LENGTH]) == 0) // when segmented at least one servo must fit a packet
+                       : ( (int16_t)rxbyte[SYNC_READ_LENGTH] * nb_servos_to_read + SyncReadExtraBytes(nb_servos_to_read)
+                           > AX_MAX_RETURN_PACKET_SIZE - packet_overhead ))) { // and the return packet to the host must not be bigger either
                 axStatusPacket(ERR_RANGE, NULL, 0);
               } else {
                 sync_read(rxbyte[PACKET_ID], &rxbyte[SYNC_READ_START_ADDR], rxbyte[PACKET_LENGTH] - 2);
@@ -180,9 +210,30 @@ bool ProcessInputFromUSB(void)
       case AX_PASS_TO_SERVOS:
         setAXtoTX();
         ax12writeB(ch);
+        AXBussNoteQueued();
+        if (rxbyte_count == PACKET_INSTRUCTION) {
+          // Remember if the servo will answer, so the scheduler leaves it time to.
+          rxbyte[PACKET_INSTRUCTION] = ch;
+        }
         rxbyte_count++;
         if (rxbyte_count >= (rxbyte[PACKET_LENGTH] + 4)) { // we have read all the data for the packet // we have let the right number of bytes pass
           ax_state = AX_SEARCH_FIRST_FF;
+          NoteHostPacketSent();
+          // Too long for the write shadow to look at, so forget what it knows
+          if (g_controller_registers[TA_SHADOW_MODE] && (rxbyte[PACKET_INSTRUCTION] != AX_READ_DATA)
+              && (rxbyte[PACKET_INSTRUCTION] != AX_PING))
+            WriteShadowInvalidate(rxbyte[PACKET_ID]);
+        }
+        break;
+
+      case AX_SHADOW_WRITE:
+        rxbyte[rxbyte_count++] = ch;
+        if (rxbyte_count >= (rxbyte[PACKET_LENGTH] + 4)) { // we have the whole packet
+          if (!WriteShadowFilter(rxbyte, rxbyte_count)) {
+            pass_bytes(rxbyte_count);
+            NoteHostPacketSent();
+          }
+          ax_state = AX_SEARCH_FIRST_FF;
         }
         break;
 
@@ -193,6 +244,14 @@ bool ProcessInputFromUSB(void)
     // Timeout on state machine while waiting on further USB data
   if (ax_state != AX_SEARCH_FIRST_FF) {
     if ((micros() - last_message_time) > (20 * g_controller_registers[AX_RETURN_DELAY_TIME])) {
+      // The rest of this packet goes to the servos without the write shadow
+      // seeing it, so forget what it knows about where it is going.
+      if (g_controller_registers[TA_SHADOW_MODE]) {
+        if (rxbyte_count > PACKET_ID)
+          WriteShadowInvalidate(rxbyte[PACKET_ID]);
+        else
+          WriteShadowClear();
+      }
       pass_bytes(rxbyte_count);
       ax_state = AX_SEARCH_FIRST_FF;
     }
@@ -201,6 +260,9 @@ bool ProcessInputFromUSB(void)
   if (ax_state == AX_SEARCH_FIRST_FF)
     setAXtoRX();
 
+  // Send any reply we made ourselves now, backends that batch would hold on to it
+  MaybeFlushUSBOutputData();
+
   return we_did_something;  
 
 }  
@@ -210,14 +272,7 @@ bool ProcessInputFromUSB(void)
 //-----------------------------------------------------------------------------
 void FlushUSBInputQueue(void)
 {
-  // Lets use internal Teensy function... 
-#if defined(TEENSYDUINO)
-  //usb_serial_flush_input();
-  Serial.clear();
-#else
-  int ch;
-  while (Serial.read() != -1)
-    ;
-#endif
+  // The host transport knows the quickest way to do this
+  PCSerial.clear();
 }  
 
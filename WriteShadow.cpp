@@ -0,0 +1,200 @@
+//=============================================================================
+// File: WriteShadow.cpp
+//  Remember the last value written to each servo's torque enable, goal
+//  position and moving speed, so that when a control loop writes the same
+//  values again we can answer for the servo (or just drop it) instead of
+//  using buss time for it.
+//
+//  An entry is only trusted while nothing else could have changed it: any
+//  write we could not look at, a reset, a reply with error bits, a reply
+//  that shows a different value, or a servo not answering forgets it.
+//=============================================================================
+
+//=============================================================================
+// Header Files
+//=============================================================================
+#include <ax12Serial.h>
+#include <BioloidSerial.h>
+#include "globals.h"
+
+//-----------------------------------------------------------------------------
+// Define Global variables
+//-----------------------------------------------------------------------------
+typedef struct {
+  uint8_t valid;                      // one bit per shadowed register
+  uint8_t values[SHADOW_REG_COUNT];
+} write_shadow_t;
+
+write_shadow_t g_write_shadow[AX_ID_BROADCAST]; // IDs 0-253
+
+// The read or ping we forwarded and are waiting on an answer for.
+uint8_t g_shadow_pending_id = 0xff;
+uint8_t g_shadow_pending_addr;
+uint8_t g_shadow_pending_len;
+unsigned long g_shadow_pending_time;
+
+// Statistics
+uint16_t g_shadow_suppressed_packets = 0;
+uint32_t g_shadow_suppressed_bytes = 0;
+
+//-----------------------------------------------------------------------------
+// WriteShadowIndex - Where a servo register lives in the shadow, -1 if we
+//    do not shadow it.
+//-----------------------------------------------------------------------------
+int WriteShadowIndex(uint8_t addr)
+{
+  if (addr == AX_TORQUE_ENABLE)
+    return 0;
+  if ((addr >= AX_GOAL_POSITION_L) && (addr < AX_GOAL_POSITION_L + SHADOW_REG_COUNT - 1))
+    return addr - AX_GOAL_POSITION_L + 1;
+  return -1;
+}
+
+//-----------------------------------------------------------------------------
+// WriteShadowClear / WriteShadowInvalidate - Forget everything or one servo.
+//-----------------------------------------------------------------------------
+void WriteShadowClear(void)
+{
+  for (uint8_t id = 0; id < AX_ID_BROADCAST; id++)
+    g_write_shadow[id].valid = 0;
+  g_shadow_pending_id = 0xff;
+}
+
+void WriteShadowInvalidate(uint8_t id)
+{
+  if (id < AX_ID_BROADCAST)
+    g_write_shadow[id].valid = 0;
+  else if (id == AX_ID_BROADCAST)
+    WriteShadowClear();
+}
+
+//-----------------------------------------------------------------------------
+// WriteShadowNoteWrite - Values were written to a servo.
+//-----------------------------------------------------------------------------
+void WriteShadowNoteWrite(uint8_t id, uint8_t addr, uint8_t* data, uint8_t count)
+{
+  if (id >= AX_ID_BROADCAST)
+    return;
+  for (uint8_t i = 0; i < count; i++) {
+    int index = WriteShadowIndex(addr + i);
+    if (index >= 0) {
+      g_write_shadow[id].values[index] = data[i];
+      g_write_shadow[id].valid |= 1 << index;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// WriteShadowNoteRead - We saw the real value of a servo register, forget
+//    our copy if it does not match.
+//-----------------------------------------------------------------------------
+void WriteShadowNoteRead(uint8_t id, uint8_t addr, uint8_t* data, uint8_t count)
+{
+  if (id >= AX_ID_BROADCAST)
+    return;
+  for (uint8_t i = 0; i < count; i++) {
+    int index = WriteShadowIndex(addr + i);
+    if ((index >= 0) && (g_write_shadow[id].values[index] != data[i]))
+      g_write_shadow[id].valid &= ~(1 << index);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// WriteShadowNoteStatus - ProcessInputFromAXBuss saw a status packet for the
+//    read we are waiting on, index is which byte of the parameters it is, -1
+//    for the error byte.  Any status packet with error bits set has already
+//    forgotten its servo.
+//-----------------------------------------------------------------------------
+void WriteShadowNoteStatus(uint8_t id, int index, uint8_t b)
+{
+  if (id != g_shadow_pending_id)
+    return;
+  if ((index >= 0) && (index < g_shadow_pending_len))
+    WriteShadowNoteRead(id, g_shadow_pending_addr + index, &b, 1);
+  if (index >= (int)g_shadow_pending_len - 1)
+    g_shadow_pending_id = 0xff;
+}
+
+//-----------------------------------------------------------------------------
+// WriteShadowCheckTimeout - Called from the main loop, a servo that did not
+//    answer a read or ping may have rebooted.
+//-----------------------------------------------------------------------------
+void WriteShadowCheckTimeout(void)
+{
+  if ((g_shadow_pending_id != 0xff)
+      && ((micros() - g_shadow_pending_time) > (20 * (uint32_t)g_controller_registers[TA_RECEIVE_TIMEOUT]))) {
+    WriteShadowInvalidate(g_shadow_pending_id);
+    g_shadow_pending_id = 0xff;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// WriteShadowFilter - ProcessInputFromUSB has a complete packet from the host
+//    for a servo.  Returns true if we took care of it and it should not be
+//    sent to the servos.
+//-----------------------------------------------------------------------------
+bool WriteShadowFilter(uint8_t* packet, uint8_t count)
+{
+  uint8_t id = packet[PACKET_ID];
+  uint8_t length = packet[PACKET_LENGTH];
+  uint8_t checksum = 0;
+  for (uint8_t i = PACKET_ID; i < count; i++)
+    checksum += packet[i];
+  if (checksum != 0xff)
+    return false;     // servo will ignore it, so should we
+
+  switch (packet[PACKET_INSTRUCTION]) {
+    case AX_WRITE_DATA:
+      {
+        uint8_t addr = packet[5];
+        uint8_t* data = &packet[6];
+        uint8_t data_count = length - 3;
+        bool match = (length > 3) && (id < AX_ID_BROADCAST);
+        for (uint8_t i = 0; match && (i < data_count); i++) {
+          int index = WriteShadowIndex(addr + i);
+          match = (index >= 0) && (g_write_shadow[id].valid & (1 << index))
+                  && (g_write_shadow[id].values[index] == data[i]);
+        }
+        if (match) {
+          g_shadow_suppressed_packets++;
+          g_shadow_suppressed_bytes += count;
+          if (g_controller_registers[TA_SHADOW_MODE] == SHADOW_MODE_ACK)
+            axStatusPacketID(id, ERR_NONE, NULL, 0);
+          return true;
+        }
+        if ((addr <= AX_ID) && (addr + data_count > AX_ID)) {
+          // The servo is changing its ID, neither the old nor the new one
+          // is what we remember
+          WriteShadowInvalidate(id);
+          WriteShadowInvalidate(data[AX_ID - addr]);
+        } else {
+          WriteShadowNoteWrite(id, addr, data, data_count);
+        }
+      }
+      break;
+
+    case AX_READ_DATA:
+    case AX_PING:
+      g_shadow_pending_id = id;
+      g_shadow_pending_addr = packet[5];
+      g_shadow_pending_len = (packet[PACKET_INSTRUCTION] == AX_READ_DATA) ? packet[6] : 0;
+      g_shadow_pending_time = micros();
+      break;
+
+    default:
+      // REG_WRITE, RESET... we do not know what the servo will end up with
+      WriteShadowInvalidate(id);
+      break;
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// WriteShadowUpdateRegisters - Copy our statistics into the register table
+//    when the host asks for them.
+//-----------------------------------------------------------------------------
+void WriteShadowUpdateRegisters(void)
+{
+  LocalRegistersSetWord(TA_SHADOW_SUPPRESSED_L, g_shadow_suppressed_packets);
+  LocalRegistersSetWord(TA_SHADOW_BYTES_L, g_shadow_suppressed_bytes);
+}
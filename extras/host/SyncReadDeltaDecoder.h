@@ -0,0 +1,92 @@
+#ifndef _SYNC_READ_DELTA_DECODER_H_
+#define _SYNC_READ_DELTA_DECODER_H_
+//=============================================================================
+// File: SyncReadDeltaDecoder.h
+//  Host side decoder for the sync read replies the Teensy sends when
+//  SYNC_READ_MODE_DELTA is set in TA_SYNC_READ_MODE (register 103).
+//
+//  Each status packet of the reply has as its parameters:
+//    sequence, flags, first slot, slot count, bitmap of (count + 7) / 8 bytes,
+//    then the slots whose bit is set, each slot_size bytes, and then any of
+//    the extended status bytes that were asked for.
+//  All the segments of one sync read have the same sequence number.  Flags
+//  bit 0 marks a keyframe, where every slot is present.
+//
+//  Usage: feed the parameters of every status packet (the bytes between the
+//  error byte and the checksum) to decode(); frame() then holds the current
+//  value of every slot.  If decode() returns false, a reply or one of its
+//  segments was lost or came out of order, and the frame is stale until the
+//  next keyframe.
+//=============================================================================
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+class SyncReadDeltaDecoder
+{
+public:
+  SyncReadDeltaDecoder(uint8_t slot_size, uint8_t nb_servos)
+    : slot_size_(slot_size), nb_servos_(nb_servos) {
+    memset(frame_, 0xff, sizeof(frame_));
+  }
+
+  // Returns true if the frame is now up to date through this packet.
+  bool decode(const uint8_t *params, size_t len) {
+    if (len < 4)
+      return false;
+    uint8_t seq = params[0];
+    bool keyframe = params[1] & 0x01;
+    uint8_t first = params[2];
+    uint8_t count = params[3];
+    size_t bitmap_size = (count + 7) / 8;
+    if (((size_t)first + count > nb_servos_) || ((size_t)(first + count) * slot_size_ > sizeof(frame_))
+        || (len < 4 + bitmap_size))
+      return false;
+
+    // A sync read starts at slot 0 with the next sequence number once the
+    // previous one got to the last slot, and each later segment repeats the
+    // sequence number and carries on where the one before stopped.  Anything
+    // else means we lost a segment.
+    bool in_order = (first == 0) ? ((next_first_ >= nb_servos_) && (seq == (uint8_t)(last_seq_ + 1)))
+                    : ((seq == last_seq_) && (first == next_first_));
+    if (keyframe && (first == 0))
+      synced_ = true;
+    else if (!in_order)
+      synced_ = false;
+    last_seq_ = seq;
+    next_first_ = first + count;
+
+    const uint8_t *bitmap = params + 4;
+    const uint8_t *slot = bitmap + bitmap_size;
+    const uint8_t *end = params + len;
+    for (uint8_t i = 0; i < count; i++) {
+      if (bitmap[i >> 3] & (1 << (i & 7))) {
+        if (slot + slot_size_ > end)
+          return synced_ = false;
+        memcpy(&frame_[(first + i) * slot_size_], slot, slot_size_);
+        slot += slot_size_;
+      }
+    }
+    return synced_;
+  }
+
+  const uint8_t *frame(void) const {
+    return frame_;
+  }
+  const uint8_t *slot(uint8_t servo_index) const {
+    return &frame_[servo_index * slot_size_];
+  }
+  bool synced(void) const {
+    return synced_;
+  }
+
+private:
+  uint8_t slot_size_;
+  uint8_t nb_servos_;
+  uint8_t last_seq_ = 0;
+  uint8_t next_first_ = 0;   // first slot of the next segment we expect
+  bool synced_ = false;
+  uint8_t frame_[120 * 128];  // AX_SYNC_READ_MAX_DEVICES slots of up to AX_BUFFER_SIZE
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _CORPUS_H_
+#define _CORPUS_H_
+//=============================================================================
+// File: Corpus.h
+//  Recorded host <-> AX Buss traffic.  A corpus file is:
+//    "AXRC", version byte (1)
+//    then records until end of file, each:
+//      uint8_t  type       CORPUS_*
+//      uint32_t time_us    since the start of the capture, little endian
+//      uint16_t length     little endian
+//      uint8_t  data[length]
+//  Host and servo records are what goes in to the Teensy, in the chunks it
+//  arrived in.  Expected records are what the Teensy should send out, they
+//  are compared as one stream per direction.  For a servo that does not
+//  answer a sync read, write an empty servo record.
+//=============================================================================
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+enum {CORPUS_FROM_HOST = 0, CORPUS_FROM_SERVOS, CORPUS_EXPECT_TO_SERVOS, CORPUS_EXPECT_TO_HOST};
+
+struct CorpusRecord {
+  uint8_t type;
+  uint32_t time_us;
+  std::vector<uint8_t> data;
+};
+
+static const char CORPUS_MAGIC[4] = {'A', 'X', 'R', 'C'};
+#define CORPUS_VERSION  1
+
+inline bool CorpusRead(const char *filename, std::vector<CorpusRecord> &records)
+{
+  FILE *fp = fopen(filename, "rb");
+  if (!fp)
+    return false;
+  uint8_t header[5];
+  bool ok = (fread(header, 1, 5, fp) == 5) && !memcmp(header, CORPUS_MAGIC, 4) && (header[4] == CORPUS_VERSION);
+  uint8_t rh[7];
+  while (ok && (fread(rh, 1, 7, fp) == 7)) {
+    CorpusRecord rec;
+    rec.type = rh[0];
+    rec.time_us = rh[1] | (rh[2] << 8) | (rh[3] << 16) | ((uint32_t)rh[4] << 24);
+    rec.data.resize(rh[5] | (rh[6] << 8));
+    ok = fread(rec.data.data(), 1, rec.data.size(), fp) == rec.data.size();
+    records.push_back(rec);
+  }
+  fclose(fp);
+  return ok;
+}
+
+inline bool CorpusWrite(const char *filename, const std::vector<CorpusRecord> &records)
+{
+  FILE *fp = fopen(filename, "wb");
+  if (!fp)
+    return false;
+  fwrite(CORPUS_MAGIC, 1, 4, fp);
+  fputc(CORPUS_VERSION, fp);
+  for (const CorpusRecord &rec : records) {
+    uint8_t rh[7] = {rec.type, (uint8_t)rec.time_us, (uint8_t)(rec.time_us >> 8), (uint8_t)(rec.time_us >> 16),
+                     (uint8_t)(rec.time_us >> 24), (uint8_t)rec.data.size(), (uint8_t)(rec.data.size() >> 8)};
+    fwrite(rh, 1, 7, fp);
+    fwrite(rec.data.data(), 1, rec.data.size(), fp);
+  }
+  return fclose(fp) == 0;
+}
+
+#endif
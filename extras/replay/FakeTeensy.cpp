@@ -0,0 +1,142 @@
+//=============================================================================
+// File: FakeTeensy.cpp
+//  The Teensy and BioloidSerial pieces the firmware needs, so it runs on
+//  Linux under the replay driver.  Time only moves when the driver moves it,
+//  to the time of each record, so timeouts see the recorded timing and a run
+//  at full speed sends out the same bytes as a run at recorded speed.
+//=============================================================================
+#include <Arduino.h>
+#include <ax12Serial.h>
+#include <EEPROM.h>
+#include "FakeTeensy.h"
+
+//-----------------------------------------------------------------------------
+// Define Global variables
+//-----------------------------------------------------------------------------
+std::vector<uint8_t> g_fake_bus_out;
+std::deque<uint8_t> g_fake_bus_in;
+bool (*g_fake_bus_refill)(void) = NULL;
+uint16_t g_fake_adc_value = 2900;   // about 12v through the divider
+uint64_t g_fake_time_ns = 0;
+
+usb_serial_class Serial;
+HardwareSerial Serial1;
+HardwareSerial Serial2;
+EEPROMClass EEPROM;
+unsigned char ax_rx_buffer[256];
+uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+uint32_t ADC0_SC1A, ADC0_RA;
+
+static uint64_t s_tx_done_ns = 0;   // when the last byte we queued is out on the wire
+
+//-----------------------------------------------------------------------------
+// Time
+//-----------------------------------------------------------------------------
+static uint64_t NowNs(void)
+{
+  return g_fake_time_ns;
+}
+
+uint32_t micros(void)
+{
+  return NowNs() / 1000;
+}
+
+uint32_t millis(void)
+{
+  return NowNs() / 1000000;
+}
+
+uint32_t FakeCycleCount(void)
+{
+  return NowNs() * (F_CPU / 1000000) / 1000;
+}
+
+void delay(uint32_t ms) {}
+void delayMicroseconds(uint32_t us) {}
+
+//-----------------------------------------------------------------------------
+// IO pins and ADC
+//-----------------------------------------------------------------------------
+static uint8_t s_pins[64];
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  s_pins[pin & 63] = val;
+}
+uint8_t digitalRead(uint8_t pin)
+{
+  return s_pins[pin & 63];
+}
+
+void analogReadResolution(unsigned int bits) {}
+int analogRead(uint8_t pin)
+{
+  ADC0_SC1A = ADC_SC1_COCO | 5;
+  ADC0_RA = g_fake_adc_value;
+  return g_fake_adc_value;
+}
+
+//-----------------------------------------------------------------------------
+// Servo UART - TXDIR stays set until the queued bytes would have gone out at
+//    1mbs (10us a byte), then drops, like the transmit complete interrupt.
+//-----------------------------------------------------------------------------
+uint8_t FakeUartC3(void)
+{
+  return (NowNs() < s_tx_done_ns) ? UART_C3_TXDIR : 0;
+}
+
+void FakeBusQueueInput(const uint8_t *data, size_t size)
+{
+  g_fake_bus_in.insert(g_fake_bus_in.end(), data, data + size);
+}
+
+int HardwareSerial::available(void)
+{
+  return g_fake_bus_in.size();
+}
+
+int HardwareSerial::read(void)
+{
+  if (g_fake_bus_in.empty())
+    return -1;
+  int ch = g_fake_bus_in.front();
+  g_fake_bus_in.pop_front();
+  return ch;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  uint64_t now = NowNs();
+  if (s_tx_done_ns < now)
+    s_tx_done_ns = now;
+  s_tx_done_ns += size * 10000;
+  g_fake_bus_out.insert(g_fake_bus_out.end(), buffer, buffer + size);
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+// ax12Serial
+//-----------------------------------------------------------------------------
+void ax12Init(long baud, Stream *pstream, int direction_pin) {}
+void setTX(int id) {}
+void setRX(int id) {}
+
+void ax12writeB(unsigned char data)
+{
+  Serial1.write(&data, 1);
+}
+
+// The servo's answer is the next servo record of the corpus, an empty record
+// is a servo that did not answer.
+int ax12ReadPacket(int length)
+{
+  int count = 0;
+  if (g_fake_bus_in.empty() && g_fake_bus_refill)
+    (*g_fake_bus_refill)();
+  while ((count < length) && !g_fake_bus_in.empty()) {
+    ax_rx_buffer[count++] = g_fake_bus_in.front();
+    g_fake_bus_in.pop_front();
+  }
+  return count;
+}
@@ -0,0 +1,20 @@
+#ifndef _FAKE_TEENSY_H_
+#define _FAKE_TEENSY_H_
+//=============================================================================
+// File: FakeTeensy.h
+//  What the replay driver can see and control of the fake Teensy.
+//=============================================================================
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+extern std::vector<uint8_t> g_fake_bus_out;     // everything sent to the servos
+extern std::deque<uint8_t> g_fake_bus_in;       // servo traffic not read yet
+extern bool (*g_fake_bus_refill)(void);         // asked for more servo traffic when we run out
+extern uint16_t g_fake_adc_value;
+extern uint64_t g_fake_time_ns;                 // what micros() and friends see
+
+extern void FakeBusQueueInput(const uint8_t *data, size_t size);
+
+#endif
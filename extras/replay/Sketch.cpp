@@ -0,0 +1,6 @@
+//=============================================================================
+// File: Sketch.cpp
+//  The sketch itself, built as C++ the way the Arduino IDE would.
+//=============================================================================
+#include <Arduino.h>
+#include "Teensy_USBToAX.ino"
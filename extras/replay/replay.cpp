@@ -0,0 +1,889 @@
+//=============================================================================
+// File: replay.cpp
+//  Run recorded host <-> AX Buss traffic (see Corpus.h) through the firmware
+//  on Linux: host records go through ProcessInputFromUSB, servo records
+//  through ProcessInputFromAXBuss (or to sync_read when it is waiting on a
+//  servo).  Everything the firmware sends is checked against the expected
+//  records, and we report what each host record cost to process.
+//
+//  Build, from this directory:
+//    g++ -O2 -std=gnu++14 -Istubs -I../.. -o replay replay.cpp FakeTeensy.cpp Sketch.cpp ../../*.cpp
+//  add -DAX_TX_COMPLETE_TURNAROUND to replay with the UART turning the buss
+//  around.
+//
+//  Usage:
+//    replay [--timed] [--loops N] corpus.axrc
+//        --timed     feed records at their recorded times instead of as fast
+//                    as we can, and report how far behind we fell
+//        --loops N   go through the corpus N times, for steadier timings
+//    replay --pty [seconds]
+//        run the firmware on a pseudo terminal, on the real clock, so the
+//        normal host software can talk to it.  No servos answer and what is
+//        sent to them is thrown away.  Runs for the given number of seconds
+//        or until Ctrl-C, then prints the time from each request to the first
+//        byte of its reply.
+//    replay --generate corpus.axrc
+//        write the synthetic corpus: pings, reads and writes to us and to
+//        servos, sync reads with a servo that does not answer, segmented and
+//        delta sync reads, retries and the extended reply, trajectories,
+//        the write shadow, garbage, packets split over several records and
+//        packets that stall long enough to hit the receive timeout.
+//
+//  After the corpus, segmented delta sync reads are run through the host's
+//  SyncReadDeltaDecoder (extras/host), losing a segment on the way, and the
+//  decoded frames are checked against what the servos sent.
+//
+//  Exit status is 1 if anything we sent did not match what was expected, or
+//  the decoder check failed.
+//=============================================================================
+
+//=============================================================================
+// Header Files
+//=============================================================================
+#include <time.h>
+#include <stdio.h>
+#include <signal.h>
+#include <algorithm>
+#include <ax12Serial.h>
+#include <BioloidSerial.h>
+#include "globals.h"
+#include "FakeTeensy.h"
+#include "Corpus.h"
+#include "../host/SyncReadDeltaDecoder.h"
+
+extern void setup(void);
+extern void loop(void);
+
+//-----------------------------------------------------------------------------
+// Define Global variables
+//-----------------------------------------------------------------------------
+HostTransportLoopback g_replay_host;
+std::vector<CorpusRecord> g_records;
+size_t g_record_next;
+uint64_t g_pass_start_us;           // virtual time the current pass started at
+std::vector<uint8_t> g_expect_bus;
+std::vector<uint8_t> g_expect_host;
+std::vector<uint8_t> g_actual_host;
+
+//-----------------------------------------------------------------------------
+// RealNs - The host clock, for measuring ourselves.
+//-----------------------------------------------------------------------------
+static uint64_t RealNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+// ReplaySetTime - Move the firmware's clock up to a record's time.
+//-----------------------------------------------------------------------------
+static void ReplaySetTime(uint32_t time_us)
+{
+  uint64_t ns = (g_pass_start_us + time_us) * 1000;
+  if (ns > g_fake_time_ns)
+    g_fake_time_ns = ns;
+}
+
+//-----------------------------------------------------------------------------
+// ReplayHostSink - Everything the firmware sends the host comes here as it is
+//    written, one pass of the loop can send more than the loopback queue holds.
+//-----------------------------------------------------------------------------
+static void ReplayHostSink(const uint8_t *buffer, size_t size)
+{
+  g_actual_host.insert(g_actual_host.end(), buffer, buffer + size);
+}
+
+//-----------------------------------------------------------------------------
+// ReplayExpect - Add an expected record to its stream.
+//-----------------------------------------------------------------------------
+static void ReplayExpect(const CorpusRecord &rec)
+{
+  std::vector<uint8_t> &expect = (rec.type == CORPUS_EXPECT_TO_SERVOS) ? g_expect_bus : g_expect_host;
+  expect.insert(expect.end(), rec.data.begin(), rec.data.end());
+}
+
+//-----------------------------------------------------------------------------
+// ReplayServoRefill - sync_read is waiting on a servo, give it the next servo
+//    record, unless the host says something first.
+//-----------------------------------------------------------------------------
+static bool ReplayServoRefill(void)
+{
+  while (g_record_next < g_records.size()) {
+    const CorpusRecord &rec = g_records[g_record_next];
+    if (rec.type == CORPUS_FROM_HOST)
+      return false;
+    g_record_next++;
+    if (rec.type == CORPUS_FROM_SERVOS) {
+      ReplaySetTime(rec.time_us);
+      FakeBusQueueInput(rec.data.data(), rec.data.size());
+      return true;
+    }
+    ReplayExpect(rec);
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// ReplayCompare - Report where the actual stream first differs from the
+//    expected one.  Returns true if they match.
+//-----------------------------------------------------------------------------
+static bool ReplayCompare(const char *name, const std::vector<uint8_t> &expect, const std::vector<uint8_t> &actual)
+{
+  size_t i = 0;
+  while ((i < expect.size()) && (i < actual.size()) && (expect[i] == actual[i]))
+    i++;
+  if ((i == expect.size()) && (i == actual.size()))
+    return true;
+
+  printf("%s: mismatch at byte %zu of %zu expected, %zu sent\n", name, i, expect.size(), actual.size());
+  size_t start = (i > 8) ? i - 8 : 0;
+  printf("  expected:");
+  for (size_t j = start; (j < expect.size()) && (j < i + 8); j++)
+    printf(" %02x", expect[j]);
+  printf("\n  sent:    ");
+  for (size_t j = start; (j < actual.size()) && (j < i + 8); j++)
+    printf(" %02x", actual[j]);
+  printf("\n");
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// ReplayPass - Go through the corpus once.  Returns true if everything we
+//    sent matched.
+//-----------------------------------------------------------------------------
+static bool ReplayPass(bool timed, std::vector<uint64_t> &costs_ns, uint64_t &host_bytes, uint64_t &late_max_ns)
+{
+  uint64_t real_start_ns = RealNs();
+  // Start on a whole ms, so millis() sees the same thing every pass
+  g_pass_start_us = (g_fake_time_ns / 1000 + 999) / 1000 * 1000;
+  g_fake_bus_out.clear();
+  g_expect_bus.clear();
+  g_expect_host.clear();
+  g_actual_host.clear();
+
+  g_record_next = 0;
+  while (g_record_next < g_records.size()) {
+    const CorpusRecord &rec = g_records[g_record_next++];
+
+    if (timed && (rec.type != CORPUS_EXPECT_TO_SERVOS) && (rec.type != CORPUS_EXPECT_TO_HOST)) {
+      uint64_t due_ns = real_start_ns + (uint64_t)rec.time_us * 1000;
+      while (RealNs() < due_ns)
+        ;
+      uint64_t late_ns = RealNs() - due_ns;
+      if (late_ns > late_max_ns)
+        late_max_ns = late_ns;
+    }
+    ReplaySetTime(rec.time_us);
+
+    switch (rec.type) {
+      case CORPUS_FROM_HOST:
+        {
+          // Let the firmware see the time pass first, this is where a
+          // packet that stalled times out.
+          loop();
+          uint64_t start_ns = RealNs();
+          size_t sent = 0;
+          while (sent < rec.data.size()) {
+            sent += g_replay_host.inject(&rec.data[sent], rec.data.size() - sent);
+            loop();
+          }
+          costs_ns.push_back(RealNs() - start_ns);
+          host_bytes += rec.data.size();
+        }
+        break;
+
+      case CORPUS_FROM_SERVOS:
+        loop();
+        FakeBusQueueInput(rec.data.data(), rec.data.size());
+        loop();
+        break;
+
+      default:
+        ReplayExpect(rec);
+        break;
+    }
+  }
+
+  // Give anything still waiting a chance to time out
+  g_fake_time_ns += 10000000;
+  loop();
+  loop();
+
+  bool bus_ok = ReplayCompare("to servos", g_expect_bus, g_fake_bus_out);
+  bool host_ok = ReplayCompare("to host", g_expect_host, g_actual_host);
+  if (g_replay_host.to_host_dropped) {
+    printf("to host: %u bytes dropped by the loopback\n", g_replay_host.to_host_dropped);
+    host_ok = false;
+  }
+  return bus_ok && host_ok;
+}
+
+//=============================================================================
+// Synthetic corpus
+//=============================================================================
+std::vector<CorpusRecord> g_gen_records;
+uint32_t g_gen_time_us;
+uint32_t g_gen_random = 12345;
+
+static uint8_t GenRandom(void)
+{
+  g_gen_random = g_gen_random * 1103515245 + 12345;
+  return g_gen_random >> 16;
+}
+
+static void GenAdd(uint8_t type, const std::vector<uint8_t> &data, uint32_t delay_us = 0)
+{
+  g_gen_time_us += delay_us;
+  CorpusRecord rec;
+  rec.type = type;
+  rec.time_us = g_gen_time_us;
+  rec.data = data;
+  g_gen_records.push_back(rec);
+}
+
+//-----------------------------------------------------------------------------
+// GenPacket - A Dynamixel packet, instruction or status.
+//-----------------------------------------------------------------------------
+static std::vector<uint8_t> GenPacket(uint8_t id, uint8_t instruction, const std::vector<uint8_t> &params)
+{
+  std::vector<uint8_t> packet = {0xff, 0xff, id, (uint8_t)(params.size() + 2), instruction};
+  packet.insert(packet.end(), params.begin(), params.end());
+  uint8_t checksum = 0;
+  for (size_t i = 2; i < packet.size(); i++)
+    checksum += packet[i];
+  packet.push_back(~checksum);
+  return packet;
+}
+
+//-----------------------------------------------------------------------------
+// GenToServo - The host sends a packet to a servo, which passes straight
+//    through, and the servo answers it (reply empty for no answer).
+//-----------------------------------------------------------------------------
+static void GenToServo(const std::vector<uint8_t> &packet, const std::vector<uint8_t> &reply)
+{
+  GenAdd(CORPUS_FROM_HOST, packet, 500);
+  GenAdd(CORPUS_EXPECT_TO_SERVOS, packet);
+  if (reply.size()) {
+    GenAdd(CORPUS_FROM_SERVOS, reply, 20 + packet.size() * 10);
+    GenAdd(CORPUS_EXPECT_TO_HOST, reply);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// GenSplit - Send a packet in random sized pieces, close enough together
+//    that it does not time out.
+//-----------------------------------------------------------------------------
+static void GenSplit(const std::vector<uint8_t> &packet)
+{
+  size_t start = 0;
+  uint32_t delay_us = 500;
+  while (start < packet.size()) {
+    size_t count = std::min((size_t)(1 + GenRandom() % 4), packet.size() - start);
+    GenAdd(CORPUS_FROM_HOST, std::vector<uint8_t>(packet.begin() + start, packet.begin() + start + count), delay_us);
+    start += count;
+    delay_us = 5;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// GenSyncRead - Sync read nb_to_read bytes at addr from a list of servos, the
+//    one with missing_id does not answer the first missed_reads times it is
+//    asked.  mode is what TA_SYNC_READ_MODE is set to, the reply and the
+//    retries are worked out here the same way the firmware does them.
+//-----------------------------------------------------------------------------
+uint8_t g_gen_servo_data[AX_ID_BROADCAST][8];
+std::vector<uint8_t> g_gen_delta_request;
+uint8_t g_gen_delta_since_keyframe = 0;
+uint8_t g_gen_delta_seq = 0;
+uint8_t g_gen_delta_cache[SYNC_READ_DELTA_CACHE_SIZE];
+uint8_t g_gen_retries = 0;      // TA_SYNC_READ_RETRIES
+uint8_t g_gen_deadline = 0;     // TA_SYNC_READ_DEADLINE
+
+static uint16_t GenSyncReadExtraBytes(uint8_t mode, uint8_t nb_servos)
+{
+  uint16_t extra = 0;
+  if (mode & SYNC_READ_MODE_STATUS)
+    extra += (nb_servos + 7) / 8;
+  if (mode & SYNC_READ_MODE_ERRORS)
+    extra += nb_servos;
+  if (mode & SYNC_READ_MODE_LATENCY)
+    extra += nb_servos;
+  if (mode & SYNC_READ_MODE_DELTA)
+    extra += SYNC_READ_DELTA_HEADER + (nb_servos + 7) / 8;
+  return extra;
+}
+
+// One servo read, every reply comes 100us after the read went out
+static bool GenSyncReadServo(uint8_t id, uint8_t addr, uint8_t nb_to_read, bool answer, bool first_try,
+                             uint8_t *slot, uint8_t *perror, uint8_t *platency)
+{
+  GenAdd(CORPUS_EXPECT_TO_SERVOS, GenPacket(id, AX_READ_DATA, {addr, nb_to_read}));
+  if (!answer) {
+    GenAdd(CORPUS_FROM_SERVOS, {}, 100);
+    memset(slot, 0xff, nb_to_read);
+    *perror = HEALTH_ERR_MISSED;
+    *platency = 0xff;
+    return false;
+  }
+
+  // About half the servos moved since last time
+  uint8_t *servo_data = g_gen_servo_data[id];
+  if (first_try && (GenRandom() & 1)) {
+    for (uint8_t i = 0; i < nb_to_read; i++)
+      servo_data[i] = GenRandom();
+  }
+  GenAdd(CORPUS_FROM_SERVOS, GenPacket(id, ERR_NONE, std::vector<uint8_t>(servo_data, servo_data + nb_to_read)), 100);
+  memcpy(slot, servo_data, nb_to_read);
+  *perror = ERR_NONE;
+  *platency = 100 / 10;
+  return true;
+}
+
+static void GenSyncRead(const std::vector<uint8_t> &ids, uint8_t addr, uint8_t nb_to_read, uint8_t mode, uint8_t missing_id,
+                        uint8_t missed_reads = 0xff)
+{
+  std::vector<uint8_t> params = {addr, nb_to_read};
+  params.insert(params.end(), ids.begin(), ids.end());
+  GenAdd(CORPUS_FROM_HOST, GenPacket(AX_ID_DEVICE, AX_CMD_SYNC_READ, params), 500);
+  uint32_t start_us = g_gen_time_us;
+  uint8_t retries_left = g_gen_retries;
+  uint8_t missed = 0;
+
+  bool delta = mode & SYNC_READ_MODE_DELTA;
+  bool keyframe = false;
+  if (delta) {
+    keyframe = (params != g_gen_delta_request) || (++g_gen_delta_since_keyframe >= SYNC_READ_KEYFRAME_DEFAULT);
+    if (keyframe) {
+      g_gen_delta_request = params;
+      g_gen_delta_since_keyframe = 0;
+    }
+    g_gen_delta_seq++;
+  }
+  uint8_t nb_servos = ids.size();
+  uint8_t per_segment = nb_servos;
+  if (mode & SYNC_READ_MODE_SEGMENTED) {
+    per_segment = 0;
+    while ((uint16_t)nb_to_read * (per_segment + 1) + GenSyncReadExtraBytes(mode, per_segment + 1)
+           <= AX_MAX_RETURN_PACKET_SIZE - 6)
+      per_segment++;
+  }
+
+  std::vector<uint8_t> data(nb_servos * nb_to_read);
+  std::vector<uint8_t> errors(nb_servos);
+  std::vector<uint8_t> latency(nb_servos);
+  for (uint8_t first = 0; first < nb_servos; first += per_segment) {
+    uint8_t count = std::min(per_segment, (uint8_t)(nb_servos - first));
+
+    // Ask each servo once, then retry the ones that did not answer
+    uint8_t failed_count = 0;
+    for (uint8_t i = first; i < first + count; i++) {
+      bool answer = (ids[i] != missing_id) || (missed_reads != 0xff && missed >= missed_reads);
+      if (!answer)
+        missed++;
+      if (!GenSyncReadServo(ids[i], addr, nb_to_read, answer, true, &data[i * nb_to_read], &errors[i], &latency[i]))
+        failed_count++;
+    }
+    uint32_t deadline_us = (uint32_t)g_gen_deadline * 100;
+    while (failed_count && retries_left) {
+      for (uint8_t i = first; i < first + count; i++) {
+        if (latency[i] != 0xff)
+          continue;
+        if (!retries_left || (deadline_us && ((g_gen_time_us - start_us) >= deadline_us))) {
+          retries_left = 0;
+          break;
+        }
+        retries_left--;
+        bool answer = (missed_reads != 0xff) && (missed >= missed_reads);
+        if (!answer)
+          missed++;
+        if (GenSyncReadServo(ids[i], addr, nb_to_read, answer, false, &data[i * nb_to_read], &errors[i], &latency[i]))
+          failed_count--;
+      }
+    }
+
+    std::vector<uint8_t> reply;
+    if (delta) {
+      reply = {g_gen_delta_seq, (uint8_t)(keyframe ? SYNC_READ_DELTA_KEYFRAME : 0), first, count};
+      size_t bitmap = reply.size();
+      reply.insert(reply.end(), (count + 7) / 8, 0);
+      for (uint8_t i = 0; i < count; i++) {
+        uint8_t *slot = &data[(first + i) * nb_to_read];
+        uint8_t *cache = &g_gen_delta_cache[(first + i) * nb_to_read];
+        if (keyframe || memcmp(slot, cache, nb_to_read)) {
+          reply[bitmap + (i >> 3)] |= 1 << (i & 7);
+          memcpy(cache, slot, nb_to_read);
+          reply.insert(reply.end(), slot, slot + nb_to_read);
+        }
+      }
+    } else {
+      reply.assign(data.begin() + first * nb_to_read, data.begin() + (first + count) * nb_to_read);
+    }
+    if (mode & SYNC_READ_MODE_STATUS) {
+      size_t status = reply.size();
+      reply.insert(reply.end(), (count + 7) / 8, 0);
+      for (uint8_t i = 0; i < count; i++) {
+        if (latency[first + i] == 0xff)
+          reply[status + (i >> 3)] |= 1 << (i & 7);
+      }
+    }
+    if (mode & SYNC_READ_MODE_ERRORS)
+      reply.insert(reply.end(), errors.begin() + first, errors.begin() + first + count);
+    if (mode & SYNC_READ_MODE_LATENCY)
+      reply.insert(reply.end(), latency.begin() + first, latency.begin() + first + count);
+    bool more_segments = (first + count) < nb_servos;
+    GenAdd(CORPUS_EXPECT_TO_HOST, GenPacket(AX_ID_DEVICE, more_segments ? SYNC_READ_MORE_SEGMENTS : ERR_NONE, reply));
+  }
+}
+
+//-----------------------------------------------------------------------------
+// GenWriteUs - The host writes one of our registers.
+//-----------------------------------------------------------------------------
+static void GenWriteUs(uint8_t reg, uint8_t value)
+{
+  if ((reg == TA_SYNC_READ_MODE) || (reg == TA_SYNC_READ_KEYFRAME))
+    g_gen_delta_request.clear();
+  else if (reg == TA_SYNC_READ_RETRIES)
+    g_gen_retries = value;
+  else if (reg == TA_SYNC_READ_DEADLINE)
+    g_gen_deadline = value;
+  GenAdd(CORPUS_FROM_HOST, GenPacket(AX_ID_DEVICE, AX_WRITE_DATA, {reg, value}), 500);
+  GenAdd(CORPUS_EXPECT_TO_HOST, GenPacket(AX_ID_DEVICE, ERR_NONE, {}));
+}
+
+//-----------------------------------------------------------------------------
+// GenReadUs - The host reads some of our registers.
+//-----------------------------------------------------------------------------
+static void GenReadUs(uint8_t reg, const std::vector<uint8_t> &values)
+{
+  GenAdd(CORPUS_FROM_HOST, GenPacket(AX_ID_DEVICE, AX_READ_DATA, {reg, (uint8_t)values.size()}), 500);
+  GenAdd(CORPUS_EXPECT_TO_HOST, GenPacket(AX_ID_DEVICE, ERR_NONE, values));
+}
+
+//-----------------------------------------------------------------------------
+// GenKeyframe - The host queues a trajectory keyframe, error is what we
+//    should answer.
+//-----------------------------------------------------------------------------
+static void GenKeyframe(uint8_t id, uint16_t goal, uint16_t time_ms, uint8_t shape, uint8_t error)
+{
+  GenAdd(CORPUS_FROM_HOST, GenPacket(AX_ID_DEVICE, AX_WRITE_DATA,
+                                     {TA_TRAJ_ID, id, (uint8_t)(goal & 0xff), (uint8_t)(goal >> 8),
+                                      (uint8_t)(time_ms & 0xff), (uint8_t)(time_ms >> 8), shape, TRAJ_COMMIT_QUEUE}), 500);
+  GenAdd(CORPUS_EXPECT_TO_HOST, GenPacket(AX_ID_DEVICE, error, {}));
+}
+
+//-----------------------------------------------------------------------------
+// GenTrajectoryPosition - Where a servo should be elapsed_ms into a keyframe,
+//    the same 16.16 fixed point math the firmware uses.
+//-----------------------------------------------------------------------------
+static uint16_t GenTrajectoryPosition(uint16_t start_pos, uint16_t goal, uint32_t elapsed_ms, uint16_t duration_ms,
+                                      uint8_t shape)
+{
+  if (elapsed_ms >= duration_ms)
+    return goal;
+  uint32_t t = (elapsed_ms << 16) / duration_ms;
+  uint32_t s = t;
+  if (shape == TRAJ_SHAPE_SMOOTH) {
+    uint32_t t2 = (t * t) >> 16;
+    uint32_t t3 = (t2 * t) >> 16;
+    s = 3 * t2 - 2 * t3;
+  }
+  return start_pos + (((int32_t)goal - (int32_t)start_pos) * (int32_t)s >> 16);
+}
+
+static bool GenerateCorpus(const char *filename)
+{
+  for (int i = 0; i < 200; i++) {
+    uint8_t id = 1 + (i % 6);
+
+    if ((i % 50) == 0) {
+      // Ping us, and read our model number and version
+      GenAdd(CORPUS_FROM_HOST, GenPacket(AX_ID_DEVICE, AX_PING, {}), 500);
+      GenAdd(CORPUS_EXPECT_TO_HOST, GenPacket(AX_ID_DEVICE, ERR_NONE, {}));
+      GenAdd(CORPUS_FROM_HOST, GenPacket(AX_ID_DEVICE, AX_READ_DATA, {CM730_MODEL_NUMBER_L, 3}), 500);
+      GenAdd(CORPUS_EXPECT_TO_HOST, GenPacket(AX_ID_DEVICE, ERR_NONE, {MODEL_NUMBER_L, MODEL_NUMBER_H, FIRMWARE_VERSION}));
+    }
+
+    // Write a goal position and read back the present position
+    GenToServo(GenPacket(id, AX_WRITE_DATA, {AX_GOAL_POSITION_L, GenRandom(), (uint8_t)(GenRandom() & 3)}),
+               GenPacket(id, ERR_NONE, {}));
+    GenToServo(GenPacket(id, AX_READ_DATA, {36, 2}), GenPacket(id, ERR_NONE, {GenRandom(), (uint8_t)(GenRandom() & 3)}));
+
+    GenSyncRead({1, 2, 3, 4, 5, 6}, 36, 2, 0, ((i % 7) == 3) ? id : 0);
+
+    if ((i % 50) == 10) {
+      // A sync read too big for one packet, sent as segments
+      std::vector<uint8_t> ids;
+      for (uint8_t servo = 1; servo <= 40; servo++)
+        ids.push_back(servo);
+      GenWriteUs(TA_SYNC_READ_MODE, SYNC_READ_MODE_SEGMENTED);
+      GenSyncRead(ids, 30, 8, SYNC_READ_MODE_SEGMENTED, (i % 100) ? 0 : 33);
+      GenWriteUs(TA_SYNC_READ_MODE, 0);
+    }
+
+    if ((i % 100) == 50) {
+      // Write shadow: a repeated write is dropped, but not after a write that
+      // timed out went past it, after the servo reported an error, or after
+      // another servo took its ID.
+      std::vector<uint8_t> goal_512 = GenPacket(1, AX_WRITE_DATA, {AX_GOAL_POSITION_L, 0x00, 0x02});
+      std::vector<uint8_t> goal_600 = GenPacket(1, AX_WRITE_DATA, {AX_GOAL_POSITION_L, 0x58, 0x02});
+      std::vector<uint8_t> torque_on = GenPacket(2, AX_WRITE_DATA, {AX_TORQUE_ENABLE, 1});
+      GenWriteUs(TA_SHADOW_MODE, SHADOW_MODE_DROP);
+      GenToServo(goal_512, GenPacket(1, ERR_NONE, {}));
+      GenAdd(CORPUS_FROM_HOST, goal_512, 500);                 // dropped
+      GenAdd(CORPUS_FROM_HOST, std::vector<uint8_t>(goal_600.begin(), goal_600.begin() + 5), 500);
+      GenAdd(CORPUS_FROM_HOST, std::vector<uint8_t>(goal_600.begin() + 5, goal_600.end()), 200);
+      GenAdd(CORPUS_EXPECT_TO_SERVOS, goal_600);
+      GenToServo(goal_512, GenPacket(1, ERR_NONE, {}));
+      GenToServo(torque_on, GenPacket(2, ERR_NONE, {}));
+      GenToServo(GenPacket(2, AX_WRITE_DATA, {AX_GOAL_POSITION_L, 0x00, 0x02}), GenPacket(2, ERR_OVERLOAD, {}));
+      GenToServo(torque_on, GenPacket(2, ERR_NONE, {}));
+      GenAdd(CORPUS_FROM_HOST, torque_on, 500);                // dropped
+      // Servo 5 becomes servo 6, the goal we remember for 6 is not its goal
+      std::vector<uint8_t> goal_6 = GenPacket(6, AX_WRITE_DATA, {AX_GOAL_POSITION_L, 0x00, 0x02});
+      GenToServo(goal_6, GenPacket(6, ERR_NONE, {}));
+      GenToServo(GenPacket(5, AX_WRITE_DATA, {AX_ID, 6}), GenPacket(6, ERR_NONE, {}));
+      GenToServo(goal_6, GenPacket(6, ERR_NONE, {}));
+      GenWriteUs(TA_SHADOW_MODE, SHADOW_MODE_OFF);
+    }
+
+    if ((i % 100) == 30) {
+      // Sync read retries, with the extended reply showing what happened:
+      // servo 3 answers its retry, servo 4 misses both retries, and with a
+      // deadline shorter than the first pass servo 2 gets none.
+      std::vector<uint8_t> ids = {1, 2, 3, 4, 5, 6};
+      uint8_t mode = SYNC_READ_MODE_STATUS | SYNC_READ_MODE_ERRORS | SYNC_READ_MODE_LATENCY;
+      GenWriteUs(TA_SYNC_READ_MODE, mode);
+      GenWriteUs(TA_SYNC_READ_RETRIES, 2);
+      GenWriteUs(TA_SYNC_READ_RETRY_CLEAR, 1);
+      GenSyncRead(ids, 36, 2, mode, 3, 1);
+      GenReadUs(TA_SYNC_READ_RETRY_COUNT_L, {1, 0, 1, 0, 100, 0, 100, 0});
+      GenWriteUs(TA_SYNC_READ_RETRY_CLEAR, 1);
+      GenSyncRead(ids, 36, 2, mode, 4);
+      GenReadUs(TA_SYNC_READ_RETRY_COUNT_L, {2, 0, 0, 0, 100, 0, 100, 0});
+      GenWriteUs(TA_SYNC_READ_RETRY_CLEAR, 1);
+      GenWriteUs(TA_SYNC_READ_DEADLINE, 3);
+      GenSyncRead(ids, 36, 2, mode, 2);
+      GenReadUs(TA_SYNC_READ_RETRY_COUNT_L, {0, 0, 0, 0, 0, 0, 0, 0});
+      GenWriteUs(TA_SYNC_READ_DEADLINE, 0);
+      GenWriteUs(TA_SYNC_READ_RETRIES, 0);
+      GenWriteUs(TA_SYNC_READ_MODE, 0);
+    }
+
+    if ((i % 100) == 80) {
+      // Trajectories: two servos move 200 and 800 over 100ms on their own,
+      // one SYNC_WRITE every 10ms from when the last one went out.  Ticks go
+      // by millis(), so start on a whole ms like each pass does, and let
+      // time pass a ms at a time.
+      const uint8_t traj_ids[2] = {20, 21};
+      const uint16_t traj_from[2] = {100, 200};
+      const uint16_t traj_to[2] = {300, 1000};
+      const uint8_t traj_shape[2] = {TRAJ_SHAPE_LINEAR, TRAJ_SHAPE_SMOOTH};
+      uint32_t traj_start_ms[2];
+      g_gen_time_us = (g_gen_time_us + 999) / 1000 * 1000;
+      GenWriteUs(TA_TRAJ_PERIOD, 10);
+      for (int servo = 0; servo < 2; servo++) {
+        GenKeyframe(traj_ids[servo], traj_from[servo], 0, traj_shape[servo], ERR_NONE);
+        traj_start_ms[servo] = g_gen_time_us / 1000;
+        GenKeyframe(traj_ids[servo], traj_to[servo], 100, traj_shape[servo], ERR_NONE);
+      }
+      GenWriteUs(TA_TRAJ_ENABLE, 1);
+
+      // The first tick goes out as soon as the host is quiet
+      uint32_t tick_ms = g_gen_time_us / 1000;
+      uint32_t done_ms = 0;
+      for (uint32_t now_ms = tick_ms + 1; !done_ms || (now_ms < done_ms + 20); now_ms++) {
+        GenAdd(CORPUS_FROM_SERVOS, {}, now_ms * 1000 - g_gen_time_us);   // time passes
+        if (done_ms || (now_ms < tick_ms))
+          continue;
+        std::vector<uint8_t> params = {AX_GOAL_POSITION_L, 2};
+        bool moving = false;
+        for (int servo = 0; servo < 2; servo++) {
+          uint32_t elapsed_ms = now_ms - traj_start_ms[servo];
+          uint16_t pos = GenTrajectoryPosition(traj_from[servo], traj_to[servo], elapsed_ms, 100, traj_shape[servo]);
+          params.insert(params.end(), {traj_ids[servo], (uint8_t)(pos & 0xff), (uint8_t)(pos >> 8)});
+          moving |= elapsed_ms < 100;
+        }
+        GenAdd(CORPUS_EXPECT_TO_SERVOS, GenPacket(AX_ID_BROADCAST, AX_SYNC_WRITE, params));
+        tick_ms = now_ms + 10;
+        if (!moving)
+          done_ms = now_ms;     // and nothing more is sent
+      }
+      GenWriteUs(TA_TRAJ_ENABLE, 0);
+
+      // A fifth keyframe for one servo does not fit
+      for (int keyframe = 0; keyframe <= TRAJ_QUEUE_SIZE; keyframe++)
+        GenKeyframe(22, 512, 100, TRAJ_SHAPE_LINEAR, (keyframe < TRAJ_QUEUE_SIZE) ? ERR_NONE : ERR_RANGE);
+      GenReadUs(TA_TRAJ_ACTIVE, {1, 0});
+      GenWriteUs(TA_TRAJ_COMMIT, TRAJ_COMMIT_STOP_ALL);
+      GenReadUs(TA_TRAJ_ACTIVE, {0, TRAJ_QUEUE_SIZE});
+      GenWriteUs(TA_TRAJ_PERIOD, 0);
+    }
+
+    if ((i % 25) == 20) {
+      // Delta sync reads.  Writing the mode starts each run with a keyframe,
+      // and there are 256 of them in the corpus so every pass starts with
+      // the same sequence number.
+      std::vector<uint8_t> ids = {7, 8, 9, 10};
+      if (i == 195)
+        ids.push_back(11);
+      GenWriteUs(TA_SYNC_READ_MODE, SYNC_READ_MODE_DELTA);
+      for (int read = 0; read < 32; read++) {
+        if (read == 16)
+          GenWriteUs(TA_SYNC_READ_MODE, SYNC_READ_MODE_DELTA);  // the next one is a keyframe
+        GenSyncRead(ids, 36, 2, SYNC_READ_MODE_DELTA, (read == 5) ? 9 : 0);
+      }
+      GenWriteUs(TA_SYNC_READ_MODE, 0);
+    }
+
+    if ((i % 10) == 0) {
+      // Garbage, nothing that looks like the start of a packet
+      std::vector<uint8_t> garbage(1 + GenRandom() % 8);
+      for (uint8_t &b : garbage)
+        b = GenRandom() % 0xff;
+      GenAdd(CORPUS_FROM_HOST, garbage, 500);
+      GenAdd(CORPUS_EXPECT_TO_SERVOS, garbage);
+    }
+
+    if ((i % 5) == 0) {
+      // A write to a servo and a read of us that arrive in pieces
+      std::vector<uint8_t> packet = GenPacket(id, AX_WRITE_DATA, {AX_TORQUE_ENABLE, 1});
+      GenSplit(packet);
+      GenAdd(CORPUS_EXPECT_TO_SERVOS, packet);
+      GenSplit(GenPacket(AX_ID_DEVICE, AX_READ_DATA, {CM730_ID, 1}));
+      GenAdd(CORPUS_EXPECT_TO_HOST, GenPacket(AX_ID_DEVICE, ERR_NONE, {AX_ID_DEVICE}));
+    }
+
+    if ((i % 25) == 0) {
+      // A read of us that stalls long enough to time out, what we had is
+      // passed on to the servos and so is the rest when it shows up.
+      std::vector<uint8_t> packet = GenPacket(AX_ID_DEVICE, AX_READ_DATA, {CM730_MODEL_NUMBER_L, 3});
+      GenAdd(CORPUS_FROM_HOST, std::vector<uint8_t>(packet.begin(), packet.begin() + 5), 500);
+      GenAdd(CORPUS_FROM_HOST, std::vector<uint8_t>(packet.begin() + 5, packet.end()), 1000);
+      GenAdd(CORPUS_EXPECT_TO_SERVOS, packet);
+    }
+  }
+  return CorpusWrite(filename, g_gen_records);
+}
+
+//=============================================================================
+// Delta decoder check
+//=============================================================================
+std::deque<std::vector<uint8_t>> g_check_servo_replies;
+
+// One servo reply each time sync_read waits on a servo, empty for no answer
+static bool ReplayCheckRefill(void)
+{
+  if (g_check_servo_replies.empty())
+    return false;
+  FakeBusQueueInput(g_check_servo_replies.front().data(), g_check_servo_replies.front().size());
+  g_check_servo_replies.pop_front();
+  return true;
+}
+
+static void ReplayCheckSend(const std::vector<uint8_t> &packet)
+{
+  g_fake_time_ns += 1000000;
+  loop();
+  size_t sent = 0;
+  while (sent < packet.size()) {
+    sent += g_replay_host.inject(&packet[sent], packet.size() - sent);
+    loop();
+  }
+}
+
+//-----------------------------------------------------------------------------
+// ReplayCheckDeltaDecoder - Feed segmented delta sync read replies through
+//    the host's SyncReadDeltaDecoder and check it ends up with what the
+//    servos sent.  The last segment of one reply is lost on the way, the
+//    decoder must notice, and rewriting the mode must get it back in sync.
+//-----------------------------------------------------------------------------
+static bool ReplayCheckDeltaDecoder(void)
+{
+  const uint8_t nb_servos = 40;
+  const uint8_t nb_to_read = 8;
+  std::vector<uint8_t> params = {30, nb_to_read};
+  for (uint8_t id = 1; id <= nb_servos; id++)
+    params.push_back(id);
+  std::vector<uint8_t> truth(nb_servos * nb_to_read);
+  for (uint8_t &b : truth)
+    b = GenRandom();
+
+  SyncReadDeltaDecoder decoder(nb_to_read, nb_servos);
+  bool ok = true;
+  int deltas = 0;
+  g_fake_bus_refill = ReplayCheckRefill;
+  ReplayCheckSend(GenPacket(AX_ID_DEVICE, AX_WRITE_DATA, {TA_SYNC_READ_MODE, SYNC_READ_MODE_SEGMENTED | SYNC_READ_MODE_DELTA}));
+
+  for (int read = 0; read < 10; read++) {
+    bool lose_segment = (read == 5);
+    if (read == 7)
+      ReplayCheckSend(GenPacket(AX_ID_DEVICE, AX_WRITE_DATA, {TA_SYNC_READ_MODE, SYNC_READ_MODE_SEGMENTED | SYNC_READ_MODE_DELTA}));
+
+    // A few servos move, and one does not answer now and then
+    for (uint8_t i = 0; i < nb_servos; i++) {
+      uint8_t *slot = &truth[i * nb_to_read];
+      if ((GenRandom() % 4) == 0) {
+        for (uint8_t j = 0; j < nb_to_read; j++)
+          slot[j] = GenRandom();
+      }
+      if ((read == 3) && (i == 16)) {
+        memset(slot, 0xff, nb_to_read);
+        g_check_servo_replies.push_back({});
+      } else {
+        g_check_servo_replies.push_back(GenPacket(i + 1, ERR_NONE, std::vector<uint8_t>(slot, slot + nb_to_read)));
+      }
+    }
+    g_actual_host.clear();
+    ReplayCheckSend(GenPacket(AX_ID_DEVICE, AX_CMD_SYNC_READ, params));
+
+    // Split what came back into status packets, each one a segment
+    std::vector<std::vector<uint8_t>> segments;
+    for (size_t i = 0; (i + 6 <= g_actual_host.size()) && (i + g_actual_host[i + 3] + 4 <= g_actual_host.size());
+         i += g_actual_host[i + 3] + 4)
+      segments.push_back(std::vector<uint8_t>(g_actual_host.begin() + i + 5, g_actual_host.begin() + i + 3 + g_actual_host[i + 3]));
+    if (segments.size() != 2) {
+      printf("delta decoder: read %d came back in %zu segments, expected 2\n", read, segments.size());
+      ok = false;
+      break;
+    }
+    if (!(segments[0][1] & SYNC_READ_DELTA_KEYFRAME))
+      deltas++;
+    if (lose_segment)
+      segments.pop_back();
+    for (const std::vector<uint8_t> &segment : segments)
+      decoder.decode(segment.data(), segment.size());
+
+    // The lost segment shows when the next read starts, and we are out of
+    // sync until the keyframe
+    bool want_synced = (read != 6);
+    if (decoder.synced() != want_synced) {
+      printf("delta decoder: read %d %s in sync\n", read, want_synced ? "should be" : "should not be");
+      ok = false;
+    } else if (want_synced && !lose_segment && memcmp(decoder.frame(), truth.data(), truth.size())) {
+      printf("delta decoder: read %d decoded to something other than what the servos sent\n", read);
+      ok = false;
+    }
+  }
+  if (ok && !deltas) {
+    printf("delta decoder: every reply was a keyframe\n");
+    ok = false;
+  }
+
+  ReplayCheckSend(GenPacket(AX_ID_DEVICE, AX_WRITE_DATA, {TA_SYNC_READ_MODE, 0}));
+  g_check_servo_replies.clear();
+  g_fake_bus_refill = ReplayServoRefill;
+  printf("delta decoder: %s\n", ok ? "decoded replies match the servos" : "FAILED");
+  return ok;
+}
+
+//-----------------------------------------------------------------------------
+// ReplayPty - Serve the firmware on a pseudo terminal.
+//-----------------------------------------------------------------------------
+volatile sig_atomic_t g_pty_stop = 0;
+
+static void ReplayPtyStop(int sig)
+{
+  g_pty_stop = 1;
+}
+
+static int ReplayPty(uint32_t seconds)
+{
+  static HostTransportPty pty;
+  uint64_t start_ns = RealNs();
+  g_host_transport = &pty;
+  setup();
+  if (!pty.slaveName()) {
+    printf("Could not open a pseudo terminal\n");
+    return 2;
+  }
+  printf("Firmware is on %s\n", pty.slaveName());
+  fflush(stdout);
+  signal(SIGINT, ReplayPtyStop);
+
+  while (!g_pty_stop && (!seconds || (g_fake_time_ns < (uint64_t)seconds * 1000000000ull))) {
+    g_fake_time_ns = RealNs() - start_ns;
+    loop();
+    if (g_fake_bus_out.size() > 65536)
+      g_fake_bus_out.clear();
+  }
+  printf("replies to host: %u, last %u us, longest %u us from request to first byte\n",
+         pty.round_trips, pty.round_trip_last_us, pty.round_trip_max_us);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// main
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  const char *filename = NULL;
+  bool timed = false;
+  int loops = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--generate") && (i + 1 < argc)) {
+      if (!GenerateCorpus(argv[++i])) {
+        printf("Could not write %s\n", argv[i]);
+        return 2;
+      }
+      return 0;
+    } else if (!strcmp(argv[i], "--pty")) {
+      return ReplayPty((i + 1 < argc) ? atoi(argv[i + 1]) : 0);
+    } else if (!strcmp(argv[i], "--timed")) {
+      timed = true;
+    } else if (!strcmp(argv[i], "--loops") && (i + 1 < argc)) {
+      loops = atoi(argv[++i]);
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (!filename || (loops < 1)) {
+    printf("Usage: replay [--timed] [--loops N] corpus.axrc\n       replay --pty [seconds]\n       replay --generate corpus.axrc\n");
+    return 2;
+  }
+  if (!CorpusRead(filename, g_records)) {
+    printf("Could not read %s\n", filename);
+    return 2;
+  }
+
+  g_host_transport = &g_replay_host;
+  g_replay_host.to_host_sink = ReplayHostSink;
+  g_fake_bus_refill = ReplayServoRefill;
+  setup();
+
+  std::vector<uint64_t> costs_ns;
+  uint64_t host_bytes = 0;
+  uint64_t late_max_ns = 0;
+  uint64_t bus_bytes = 0;
+  bool ok = true;
+  for (int pass = 0; pass < loops; pass++) {
+    ok &= ReplayPass(timed, costs_ns, host_bytes, late_max_ns);
+    bus_bytes += g_fake_bus_out.size();
+  }
+
+  uint64_t total_ns = 0;
+  for (uint64_t cost : costs_ns)
+    total_ns += cost;
+  std::sort(costs_ns.begin(), costs_ns.end());
+  size_t count = costs_ns.size();
+
+  printf("%s: %zu records, %d pass%s, %s\n", filename, g_records.size(), loops, (loops == 1) ? "" : "es",
+         ok ? "output matches" : "OUTPUT DIFFERS");
+  if (count) {
+    printf("host records: %zu, %llu bytes in, %llu bytes to servos\n", count,
+           (unsigned long long)host_bytes, (unsigned long long)bus_bytes);
+    printf("ns per host record: mean %llu, median %llu, 99%% %llu, max %llu\n",
+           (unsigned long long)(total_ns / count), (unsigned long long)costs_ns[count / 2],
+           (unsigned long long)costs_ns[count * 99 / 100], (unsigned long long)costs_ns[count - 1]);
+    if (total_ns)
+      printf("throughput: %.1f MB/s of host input\n", host_bytes * 1000.0 / total_ns);
+  }
+  printf("replies to host: %u, longest wait for the first byte %u us (recorded time)\n",
+         g_replay_host.round_trips, g_replay_host.round_trip_max_us);
+  if (timed)
+    printf("timed: worst lateness %llu us\n", (unsigned long long)(late_max_ns / 1000));
+
+  ok &= ReplayCheckDeltaDecoder();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#ifndef _FAKE_ARDUINO_H_
+#define _FAKE_ARDUINO_H_
+//=============================================================================
+// File: Arduino.h
+//  Just enough of the Teensy/Arduino API for the firmware to build and run on
+//  Linux inside the replay driver.  See FakeTeensy.cpp.
+//=============================================================================
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+#define HEX           16
+#define A0  14
+#define A1  15
+#define A2  16
+#define A3  17
+#define A4  18
+#define F_CPU         96000000
+#define SERIAL_8N1          0x00
+#define SERIAL_HALF_DUPLEX  0x200
+
+extern uint32_t micros(void);
+extern uint32_t millis(void);
+extern void delay(uint32_t ms);
+extern void delayMicroseconds(uint32_t us);
+extern void pinMode(uint8_t pin, uint8_t mode);
+extern void digitalWrite(uint8_t pin, uint8_t val);
+extern uint8_t digitalRead(uint8_t pin);
+#define digitalWriteFast digitalWrite
+#define digitalReadFast digitalRead
+extern int analogRead(uint8_t pin);
+extern void analogReadResolution(unsigned int bits);
+#define noInterrupts()
+#define interrupts()
+
+template <class A, class B> inline A min(A a, B b) { return (a < b) ? a : (A)b; }
+
+// Cycle counter, from the host clock at F_CPU
+extern uint32_t FakeCycleCount(void);
+#define ARM_DWT_CYCCNT  (FakeCycleCount())
+extern uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+#define ARM_DEMCR_TRCENA        (1 << 24)
+#define ARM_DWT_CTRL_CYCCNTENA  (1 << 0)
+
+// ADC, conversions complete instantly with whatever FakeTeensy was told
+extern uint32_t ADC0_SC1A, ADC0_RA;
+#define ADC_SC1_COCO      0x80
+#define ADC_SC1_ADCH(n)   ((n) & 0x1f)
+
+// UART, TXDIR follows the queued bytes going out at 1mbs, like the
+// SERIAL_HALF_DUPLEX transmit complete handling does.
+extern uint8_t FakeUartC3(void);
+#define UART0_C3          (FakeUartC3())
+#define UART_C3_TXDIR     0x20
+
+class IntervalTimer
+{
+public:
+  bool begin(void (*funct)(), uint32_t microseconds) { return true; }
+  void end(void) {}
+};
+
+class Stream
+{
+public:
+  virtual int available(void) = 0;
+  virtual int read(void) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+  size_t write(uint8_t b) { return write(&b, 1); }
+  virtual void flush(void) {}
+  void begin(uint32_t baud, uint32_t format = 0) { format_ = format; }
+  void clear(void) { while (read() != -1) ; }
+  uint32_t format_ = 0;
+};
+
+// Servo side UART, what the firmware sends goes into the bus output capture,
+// what it reads comes from the replayed servo traffic.
+class HardwareSerial : public Stream
+{
+public:
+  using Stream::write;
+  virtual int available(void);
+  virtual int read(void);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+};
+
+// USB Serial, not used by the replay (it uses HostTransportLoopback)
+class usb_serial_class : public Stream
+{
+public:
+  using Stream::write;
+  virtual int available(void) { return 0; }
+  virtual int read(void) { return -1; }
+  virtual size_t write(const uint8_t *buffer, size_t size) { return size; }
+};
+
+extern usb_serial_class Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+
+#endif
@@ -0,0 +1 @@
+// Nothing from BioloidSerial.h is used by the firmware itself.
@@ -0,0 +1,15 @@
+#ifndef _FAKE_EEPROM_H_
+#define _FAKE_EEPROM_H_
+#include <stdint.h>
+
+class EEPROMClass
+{
+public:
+  uint8_t read(int idx) { return data_[idx & 0x7ff]; }
+  void write(int idx, uint8_t val) { data_[idx & 0x7ff] = val; }
+private:
+  uint8_t data_[2048] = {0};
+};
+extern EEPROMClass EEPROM;
+
+#endif
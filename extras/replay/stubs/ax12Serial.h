@@ -0,0 +1,40 @@
+#ifndef _FAKE_AX12SERIAL_H_
+#define _FAKE_AX12SERIAL_H_
+//=============================================================================
+// File: ax12Serial.h
+//  The parts of BioloidSerial's ax12Serial the firmware uses, for the replay
+//  driver.  Writes go to the bus output capture, reads come from the
+//  replayed servo traffic.
+//=============================================================================
+#include "Arduino.h"
+
+#define AX_PING               1
+#define AX_READ_DATA          2
+#define AX_WRITE_DATA         3
+#define AX_REG_WRITE          4
+#define AX_ACTION             5
+#define AX_RESET              6
+#define AX_SYNC_WRITE         0x83
+
+#define AX_ID                 3
+#define AX_RETURN_DELAY_TIME  5
+#define AX_TORQUE_ENABLE      24
+#define AX_GOAL_POSITION_L    30
+
+#define ERR_NONE              0
+#define ERR_VOLTAGE           1
+#define ERR_ANGLE             2
+#define ERR_OVERHEATING       4
+#define ERR_RANGE             8
+#define ERR_CHECKSUM          16
+#define ERR_OVERLOAD          32
+#define ERR_INSTRUCTION       64
+
+extern unsigned char ax_rx_buffer[];
+extern void ax12Init(long baud, Stream *pstream, int direction_pin);
+extern void setTX(int id);
+extern void setRX(int id);
+extern void ax12writeB(unsigned char data);
+extern int ax12ReadPacket(int length);
+
+#endif
@@ -6,15 +6,26 @@
 //==================================================================
 //#define USE_LSM9DS1
 
+// Let the UART turn the AX Buss back to RX from its transmit complete interrupt,
+// within a bit time of the last stop bit, instead of us doing it when the USB
+// input goes idle.  Needs SERIAL_HALF_DUPLEX support in the Teensyduino core.
+//#define AX_TX_COMPLETE_TURNAROUND
+
 //==================================================================
 // Defines 
 //==================================================================
-#define HWSERIAL Serial1
+#define HWSERIAL_PORT     1       // AX Buss is on Serial1, 2 or 3
+#define HWSERIAL_NAME2(port) Serial##port
+#define HWSERIAL_NAME(port) HWSERIAL_NAME2(port)
+#define HWSERIAL HWSERIAL_NAME(HWSERIAL_PORT)
 //#define DBGSerial Serial
 
 #define HWSerial_TXPIN    8       // hack when we turn off TX pin turns to normal IO, try to set high...
-#define PCSerial Serial   // Default to USB
-#define PCSerial_USB    // Is the PCSerial going to USB?
+// Which HostTransport talks to the host, default is USB Serial
+//#define HOST_TRANSPORT_UART  Serial2
+//#define HOST_TRANSPORT_RAWHID         // Needs Tools->USB Type set to Raw HID
+#include "HostTransport.h"
+#define PCSerial (*g_host_transport)
 #define SERVO_DIRECTION_PIN -1
 #ifndef LED_BUILTIN
 #define LED_BUILTIN 13
@@ -22,10 +33,9 @@
 #define   LED_PIN           11
 
 #define BUFFER_TO_USB
-#ifdef BUFFER_TO_USB
+// Note: sync_read always builds its reply here, BUFFER_TO_USB only changes the other paths
 extern uint8_t g_abToUSBBuffer[256]; // way more than enough buffer space
 extern uint8_t g_abToUSBCnt;
-#endif
 
 
 #define DEBUG_PIN_USB_INPUT           A1
@@ -59,6 +69,14 @@ extern uint8_t g_abToUSBCnt;
 #define   VOLTAGE_DIVIDER_RES2  201 // 40.2K
 #define   LOW_VOLTAGE_SHUTOFF_DEFAULT 90  // 9 volts
 
+// Battery voltage is sampled from a timer interrupt and filtered in fixed point
+#define   VOLTAGE_ADC_BITS        12    // analogReadResolution we run the ADC at
+#define   VOLTAGE_SAMPLE_US       1000  // Start a new conversion every ms
+#define   VOLTAGE_FILTER_SHIFT    3     // IIR filter, each new sample has weight 1/8
+#define   VOLTAGE_FRACTION_BITS   4     // Extra fraction bits kept in the filter
+#define   VOLTAGE_MV_SCALE        ((uint32_t)3300 * (VOLTAGE_DIVIDER_RES1 + VOLTAGE_DIVIDER_RES2) \
+                                   * (1 << (16 - VOLTAGE_ADC_BITS - VOLTAGE_FRACTION_BITS)) / VOLTAGE_DIVIDER_RES1)
+
 // AX-Bus Read pass though mode
 #define AX_PASSTHROUGH      1
 #define AX_DIVERT           2
@@ -74,7 +92,7 @@ extern uint8_t g_abToUSBCnt;
 
 
 //extern uint8_t regs[REG_TABLE_SIZE];
-#define REG_TABLE_SIZE      (CM730_VOLTAGE+1)
+#define REG_TABLE_SIZE      (TA_SYNC_READ_RETRY_CLEAR+1)
 
 // Define which IDs will saved to and restored from EEPROM
 #define REG_EEPROM_FIRST    CM730_ID
@@ -88,9 +106,42 @@ extern uint8_t g_abToUSBCnt;
 #define AX_SYNC_READ_MAX_DEVICES    120
 #define AX_MAX_RETURN_PACKET_SIZE   235
 
+// Sync read extended reply, bits of TA_SYNC_READ_MODE.  The extra data is
+// appended after the normal servo data so the data offsets do not change.
+#define SYNC_READ_MODE_STATUS       0x01  // Bitmap, one bit per servo that did not answer
+#define SYNC_READ_MODE_ERRORS       0x02  // Error byte of each servo (HEALTH_ERR_MISSED if no answer)
+#define SYNC_READ_MODE_LATENCY      0x04  // Reply time of each servo x 10us, 0xff if no answer
+#define SYNC_READ_MODE_SEGMENTED    0x08  // Allow replies bigger than one packet, sent as several packets
+#define SYNC_READ_MODE_DELTA        0x10  // Only send servo slots that changed since the last reply
+#define SYNC_READ_MORE_SEGMENTS     0x80  // Error byte of a segment when more segments follow
+
+// Delta replies start with: sequence, flags, first slot, slot count, then a
+// bitmap of the slots that follow.  Keyframes have every slot.
+#define SYNC_READ_DELTA_HEADER      4
+#define SYNC_READ_DELTA_KEYFRAME    0x01  // flags - this reply has every slot
+#define SYNC_READ_DELTA_CACHE_SIZE  512   // Bigger reads always get keyframes
+#define SYNC_READ_KEYFRAME_DEFAULT  32    // Keyframe interval when TA_SYNC_READ_KEYFRAME is 0
+
+// Trajectories
+#define TRAJ_MAX_SERVOS             32
+#define TRAJ_QUEUE_SIZE             4     // keyframes queued per servo
+#define TRAJ_PERIOD_DEFAULT         10    // ms between SYNC_WRITEs when TA_TRAJ_PERIOD is 0
+#define TRAJ_POS_UNKNOWN            0xffff
+enum {TRAJ_SHAPE_LINEAR = 0, TRAJ_SHAPE_SMOOTH};
+enum {TRAJ_COMMIT_NONE = 0, TRAJ_COMMIT_QUEUE, TRAJ_COMMIT_STOP, TRAJ_COMMIT_STOP_ALL};
+
+// Write shadow, torque enable plus goal position and moving speed
+#define SHADOW_REG_COUNT            5
+#define SHADOW_MAX_PACKET_LENGTH    16    // Longer packets to servos are passed on without looking
+enum {SHADOW_MODE_OFF = 0, SHADOW_MODE_DROP, SHADOW_MODE_ACK};
+
+// Buss scheduler
+#define BUS_TASK_QUEUE_SIZE         8
+#define BUS_IDLE_GUARD_US           50    // extra quiet time we want from host before using buss ourself
+
 enum {AX_SEARCH_FIRST_FF = 0, AX_SEARCH_SECOND_FF, PACKET_ID, PACKET_LENGTH,
       PACKET_INSTRUCTION, AX_SEARCH_RESET, AX_SEARCH_BOOTLOAD, AX_GET_PARAMETERS,
-      AX_SEARCH_READ, AX_SEARCH_PING, AX_PASS_TO_SERVOS
+      AX_SEARCH_READ, AX_SEARCH_PING, AX_PASS_TO_SERVOS, AX_SHADOW_WRITE
      };
 
 //==================================================================
@@ -104,12 +155,85 @@ enum{
     CM730_ID                          = 3,
     CM730_BAUD_RATE                   = 4,
     CM730_RETURN_DELAY_TIME           = 5,
+    TA_RECEIVE_TIMEOUT                = 6,  // x 20us - How long a servo may take to answer
     TA_DOWN_LIMIT_VOLTAGE              = 12,
     CM730_STATUS_RETURN_LEVEL         = 16,
     CM730_DXL_POWER                   = 24,
     CM730_LED_PANEL                   = 25, // Teensy D13 low bit. D12? for 2nd bit. 
     CM730_VOLTAGE                     = 50, // A0
+
+    // Teensy added - Buss scheduler statistics (read only)
+    TA_SCHED_QUEUE_DEPTH              = 51, // background transactions waiting for the buss
+    TA_SCHED_MAX_QUEUE_DEPTH          = 52,
+    TA_SCHED_LAST_WAIT_L              = 53, // us the last background transaction waited
+    TA_SCHED_LAST_WAIT_H              = 54,
+    TA_SCHED_MAX_WAIT_L               = 55,
+    TA_SCHED_MAX_WAIT_H               = 56,
+    TA_BUS_TURNAROUND_L               = 57, // x 0.1us - worst cost seen of setAXtoTX/setAXtoRX
+    TA_BUS_TURNAROUND_H               = 58,
+    TA_VOLTAGE_MV_L                   = 59, // Battery voltage in mv (read only)
+    TA_VOLTAGE_MV_H                   = 60,
+
+    // Teensy added - Servo health summary
+    TA_HEALTH_FAILING_COUNT           = 61, // How many servos have errors or missed replies
+    TA_HEALTH_WORST_ID                = 62, // Servo with most errors + misses, 0xff if none
+    TA_HEALTH_ALL_ERRORS              = 63, // Error bits seen from any servo
+    TA_HEALTH_DETAIL_ID               = 64, // (W) Which servo the detail registers show
+    TA_HEALTH_DETAIL_ERRORS           = 65, // Error bits seen from that servo
+    TA_HEALTH_DETAIL_ERROR_COUNT      = 66,
+    TA_HEALTH_DETAIL_MISSED_COUNT     = 67,
+    TA_HEALTH_DETAIL_AGE_L            = 68, // ms since we last heard from it, 0xffff if never or longer
+    TA_HEALTH_DETAIL_AGE_H            = 69,
+    TA_HEALTH_CLEAR                   = 70, // (W) write 1 to clear all counters
+    TA_HEALTH_FAIL_MAP                = 71, // One bit per servo ID with errors, 32 bytes
+
+    // Teensy added - Sync read options
+    TA_SYNC_READ_MODE                 = 103, // SYNC_READ_MODE_ bits
+    TA_SYNC_READ_RETRIES              = 104, // How many re-reads one sync read may do, 0 = none
+    TA_SYNC_READ_DEADLINE             = 105, // x 100us - no retries started after this, 0 = no limit
+    TA_SYNC_READ_RETRY_COUNT_L        = 106, // Retries done (read only)
+    TA_SYNC_READ_RETRY_COUNT_H        = 107,
+    TA_SYNC_READ_RETRY_GOOD_L         = 108, // Retries that got an answer (read only)
+    TA_SYNC_READ_RETRY_GOOD_H         = 109,
+    TA_SYNC_READ_RETRY_LAST_US_L      = 110, // us the last retry added (read only)
+    TA_SYNC_READ_RETRY_LAST_US_H      = 111,
+    TA_SYNC_READ_RETRY_MAX_US_L       = 112,
+    TA_SYNC_READ_RETRY_MAX_US_H       = 113,
+
+    // Teensy added - How long after the last byte is queued the buss is back in RX (read only)
+    // With AX_TX_COMPLETE_TURNAROUND it is when the main loop saw the UART had released it,
+    // so it includes the loop latency and is an upper bound on the real turnaround.
+    TA_BUS_RELEASE_LAST_US_L          = 114,
+    TA_BUS_RELEASE_LAST_US_H          = 115,
+    TA_BUS_RELEASE_MAX_US_L           = 116,
+    TA_BUS_RELEASE_MAX_US_H           = 117,
+    TA_SYNC_READ_KEYFRAME             = 118, // Delta mode sends a keyframe every this many replies
+
+    // Teensy added - Trajectories, write a keyframe as one block 121-127
+    TA_TRAJ_ENABLE                    = 119,
+    TA_TRAJ_PERIOD                    = 120, // ms between SYNC_WRITEs
+    TA_TRAJ_ID                        = 121,
+    TA_TRAJ_GOAL_L                    = 122,
+    TA_TRAJ_GOAL_H                    = 123,
+    TA_TRAJ_TIME_L                    = 124, // ms to get there from the previous keyframe
+    TA_TRAJ_TIME_H                    = 125,
+    TA_TRAJ_SHAPE                     = 126, // TRAJ_SHAPE_
+    TA_TRAJ_COMMIT                    = 127, // TRAJ_COMMIT_ - what to do with the above
+    TA_TRAJ_ACTIVE                    = 128, // Servos moving (read only)
+    TA_TRAJ_QUEUE_FREE                = 129, // Keyframes TA_TRAJ_ID can still queue (read only)
+
+    // Teensy added - Don't send servos writes of values they already have
+    TA_SHADOW_MODE                    = 130, // SHADOW_MODE_ - what to do with a write we don't need
+    TA_SHADOW_SUPPRESSED_L            = 131, // Writes not sent (read only)
+    TA_SHADOW_SUPPRESSED_H            = 132,
+    TA_SHADOW_BYTES_L                 = 133, // Bytes not sent (read only)
+    TA_SHADOW_BYTES_H                 = 134,
+    TA_SHADOW_CLEAR                   = 135, // (W) write 1 to forget all values
+    TA_BUS_RELEASE_CLEAR              = 136, // (W) write 1 to clear the buss release times
+    TA_SYNC_READ_RETRY_CLEAR          = 137, // (W) write 1 to clear the retry statistics
 };
+#define HEALTH_FAIL_MAP_SIZE  32
+#define HEALTH_ERR_MISSED     0x80  // Not a real servo error bit, we use it for no answer
 
 #if 0
 // Arbotix Pro stuff - Only showing those things that have been added.
@@ -138,10 +262,17 @@ extern uint8_t rxbyte_count;   // number of used bytes in rxbyte buffer
 //==================================================================
 extern void InitalizeRegisterTable(void);
 extern void axStatusPacket(uint8_t err, uint8_t* data, uint8_t count_bytes);
+extern void axStatusPacketID(uint8_t id, uint8_t err, uint8_t* data, uint8_t count_bytes);
 extern void LocalRegistersRead(uint8_t register_id, uint8_t count_bytes);
+extern void BatteryMonitorInit(void);
 extern void CheckBatteryVoltage(void);
 extern void LocalRegistersWrite(uint8_t register_id, uint8_t* data, uint8_t count_bytes);
 extern void sync_read(uint8_t id, uint8_t* params, uint8_t nb_params);
+extern uint16_t SyncReadExtraBytes(uint8_t nb_servos);
+extern uint8_t SyncReadServosPerSegment(uint8_t nb_to_read);
+extern void SyncReadUpdateRegisters(void);
+extern void SyncReadDeltaRestart(void);
+extern void SyncReadRetryClear(void);
 extern void setAXtoTX(bool fTX);
 extern void MaybeFlushUSBOutputData(void);
 extern void FlushUSBInputQueue(void);
@@ -150,6 +281,44 @@ extern void CheckHardwareForLocalReadRequest(uint8_t register_id, uint8_t count_
 
 extern bool ProcessInputFromUSB(void);
 extern bool ProcessInputFromAXBuss(void);
+extern void LocalRegistersSetWord(uint8_t register_id, uint32_t value);
+
+// Buss scheduler - host traffic always wins, our own work fits in the gaps
+enum {BUS_PRIORITY_HOST_WRITE = 0, BUS_PRIORITY_HOST_READ};  // is a servo going to answer the host
+typedef void (*BusTaskFunction)(void);
+extern void BusSchedulerInit(void);
+extern bool BusSchedulerQueue(BusTaskFunction task, uint16_t est_us);
+extern void BusSchedulerNoteHostPacket(uint8_t priority);
+extern void BusSchedulerNoteReply(void);
+extern bool BusSchedulerRun(void);
+extern void BusSchedulerUpdateRegisters(void);
+extern void AXBussNoteRelease(void);
+extern void AXBussClearRelease(void);
+extern void AXBussUpdateRegisters(void);
+
+// Trajectories
+extern void TrajectoryInit(void);
+extern bool TrajectoryCanQueue(uint8_t id);
+extern void TrajectoryCommit(uint8_t command);
+extern void CheckTrajectories(void);
+extern void TrajectoryUpdateRegisters(void);
+
+// Write shadow
+extern uint8_t g_shadow_pending_id;
+extern void WriteShadowClear(void);
+extern void WriteShadowInvalidate(uint8_t id);
+extern void WriteShadowNoteWrite(uint8_t id, uint8_t addr, uint8_t* data, uint8_t count);
+extern void WriteShadowNoteRead(uint8_t id, uint8_t addr, uint8_t* data, uint8_t count);
+extern void WriteShadowNoteStatus(uint8_t id, int index, uint8_t b);
+extern void WriteShadowCheckTimeout(void);
+extern bool WriteShadowFilter(uint8_t* packet, uint8_t count);
+extern void WriteShadowUpdateRegisters(void);
+
+// Servo health
+extern void ServoHealthNoteStatus(uint8_t id, uint8_t error);
+extern void ServoHealthNoteMissed(uint8_t id);
+extern void ServoHealthClear(void);
+extern void ServoHealthUpdateRegisters(void);
 
 //==================================================================
 // inline functions
@@ -158,22 +327,75 @@ extern bool ProcessInputFromAXBuss(void);
 // setAXtoTX - Set the Tx buffer to input or output.
 //-----------------------------------------------------------------------------
 extern bool g_AX_IS_TX;
+extern uint32_t g_bus_turnaround_cycles;
+extern uint32_t g_bus_last_tx_cycles;      // when we last queued a byte for the AX Buss
+extern bool g_bus_tx_queued;               // bytes were queued since the buss was last released
 
+// Remember the worst case cost of turning the buss around, the scheduler uses
+// it to decide if a gap in the host traffic is big enough for us.
+inline void BusNoteTurnaround(uint32_t start_cycles)
+{
+  uint32_t cycles = ARM_DWT_CYCCNT - start_cycles;
+  if (cycles > g_bus_turnaround_cycles)
+    g_bus_turnaround_cycles = cycles;
+}
+
+// Call after the last byte of a burst to the AX Buss is queued, the release
+// time is measured from here.
+inline void AXBussNoteQueued()
+{
+  g_bus_last_tx_cycles = ARM_DWT_CYCCNT;
+  g_bus_tx_queued = true;
+}
+
+#ifdef AX_TX_COMPLETE_TURNAROUND
+// The UART sets TXDIR as we write and clears it on transmit complete, so all
+// we do is remember when we queued output and notice when it switched back.
+// We only notice when the main loop polls, so the release time we record is
+// later than the real one by however long that took.
+#if HWSERIAL_PORT == 1
+#define HWSERIAL_C3 UART0_C3
+#elif HWSERIAL_PORT == 2
+#define HWSERIAL_C3 UART1_C3
+#elif HWSERIAL_PORT == 3
+#define HWSERIAL_C3 UART2_C3
+#else
+#error AX_TX_COMPLETE_TURNAROUND needs HWSERIAL_PORT to be 1, 2 or 3
+#endif
+inline void  setAXtoTX()
+{
+  g_AX_IS_TX = true;
+}
+
+inline void  setAXtoRX()
+{
+  if (g_AX_IS_TX && !(HWSERIAL_C3 & UART_C3_TXDIR)) {
+    g_AX_IS_TX = false;
+    AXBussNoteRelease();
+  }
+}
+#else
 inline void  setAXtoTX()
 {
   if (!g_AX_IS_TX) {
+    uint32_t start_cycles = ARM_DWT_CYCCNT;
     g_AX_IS_TX = true;
     setTX(0);
+    BusNoteTurnaround(start_cycles);
   }
 }
 
 inline void  setAXtoRX()
 {
   if (g_AX_IS_TX) {
+    uint32_t start_cycles = ARM_DWT_CYCCNT;
     g_AX_IS_TX = false;
     setRX(0);
+    BusNoteTurnaround(start_cycles);
+    AXBussNoteRelease();
   }
 }
+#endif
 
 
 